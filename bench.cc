@@ -0,0 +1,411 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// driver de benchmarks do SimpleFS. Roda cargas repetíveis (sementes fixas)
+// numa imagem nova e em cópias das imagens fornecidas, e imprime para cada uma
+// o tempo, as operações por segundo, os MB/s e as leituras/escritas do Disk,
+// como tabela, CSV ou JSON, para comparar execuções
+
+using namespace std;
+
+class Bench
+{
+public:
+	static const int CHUNK = 1 << 20;      // bytes por chamada nas cargas sequenciais
+	static const int RANDOM_OPS = 4096;    // leituras/escritas de um bloco nas cargas aleatórias
+	static const int MOUNT_OPS = 10;       // mount/unmount por medição
+	static const int THREAD_FILE = 256 << 10;  // tamanho dos arquivos da carga com threads
+
+	// resultado de uma carga
+	class result {
+		public:
+			string name;
+			double seconds;
+			long ops;
+			long bytes;
+			long reads;     // blocos lidos/escritos no Disk durante a carga
+			long writes;
+	};
+
+	Disk::Backend backend = Disk::BACKEND_PREAD;
+	int queue_depth = Disk::DEFAULT_QUEUE_DEPTH;
+	bool direct = false;
+	int nblocks = 65536;    // tamanho da imagem nova
+	int file_mb = 64;       // tamanho dos arquivos das cargas sequenciais e de cópia
+	int nfiles = 10000;     // inodes da carga de create/delete
+	int nthreads = 4;
+	int layout = INE5412_FS::FORMAT_INDIRECT;   // formato dos inodes da imagem nova
+	string image = "bench.img";
+	vector<result> results;
+
+	void run_fresh();
+	void run_image(const char *filename);
+	void print(const char *format);
+
+private:
+	void start(Disk &disk);
+	void stop(Disk &disk, const string &name, long ops, long bytes);
+	void threads(INE5412_FS &fs, Disk &disk);
+
+	chrono::steady_clock::time_point t0;
+	long reads0, writes0;
+};
+
+// começa a medir uma carga
+void Bench::start(Disk &disk)
+{
+	reads0 = disk.reads();
+	writes0 = disk.writes();
+	t0 = chrono::steady_clock::now();
+}
+
+// termina a medição e guarda o resultado
+void Bench::stop(Disk &disk, const string &name, long ops, long bytes)
+{
+	result r;
+	r.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+	r.name = name;
+	r.ops = ops;
+	r.bytes = bytes;
+	r.reads = disk.reads() - reads0;
+	r.writes = disk.writes() - writes0;
+	results.push_back(r);
+}
+
+// cargas numa imagem nova: format, mount, create/delete, leituras e escritas
+// sequenciais e aleatórias, copyin/copyout e, com mais de uma thread, a vazão
+// de várias threads criando, escrevendo, lendo e apagando arquivos
+void Bench::run_fresh()
+{
+	unlink(image.c_str());
+	Disk disk(image.c_str(), nblocks, backend, queue_depth, direct);
+	INE5412_FS fs(&disk);
+	mt19937 rng(1);
+	long size = (long)file_mb << 20;
+	vector<char> data(size), back(size);
+
+	for(long i = 0; i < size; i++) {
+		data[i] = rng();
+	}
+
+	start(disk);
+	fs.fs_format(layout);
+	stop(disk, "format", 1, 0);
+
+	start(disk);
+	fs.fs_format(layout | INE5412_FS::FORMAT_FAST);
+	stop(disk, "format_fast", 1, 0);
+
+	start(disk);
+	for(int i = 0; i < MOUNT_OPS; i++) {
+		fs.fs_mount();
+		fs.fs_unmount();
+	}
+	stop(disk, "mount_empty", MOUNT_OPS, 0);
+	fs.fs_mount();
+
+	// create/delete
+	vector<int> inumbers;
+	start(disk);
+	for(int i = 0; i < nfiles; i++) {
+		inumbers.push_back(fs.fs_create());
+	}
+	fs.fs_sync();
+	stop(disk, "create", nfiles, 0);
+
+	start(disk);
+	for(int i = 0; i < nfiles; i++) {
+		fs.fs_delete(inumbers[i]);
+	}
+	fs.fs_sync();
+	stop(disk, "delete", nfiles, 0);
+
+	// escrita e leitura sequenciais, em chamadas de CHUNK bytes. Se o formato
+	// não comportar o arquivo todo, as cargas seguintes usam só o que coube
+	int inumber = fs.fs_create();
+	long written = 0;
+	start(disk);
+	for(long off = 0; off < size; off += CHUNK) {
+		int length = min((long)CHUNK, size - off);
+		int n = fs.fs_write(inumber, &data[off], length, off);
+		written += n;
+		if(n < length) {
+			break;
+		}
+	}
+	fs.fs_sync();
+	stop(disk, "seq_write", (written + CHUNK - 1) / CHUNK, written);
+	size = written;
+
+	// remonta para a leitura não sair do cache do fs
+	fs.fs_unmount();
+	fs.fs_mount();
+	start(disk);
+	for(long off = 0; off < size; off += CHUNK) {
+		fs.fs_read(inumber, &back[off], min((long)CHUNK, size - off), off);
+	}
+	stop(disk, "seq_read", (size + CHUNK - 1) / CHUNK, size);
+	if(!equal(data.begin(), data.begin() + size, back.begin())) {
+		fprintf(stderr, "ERROR: seq_read returned wrong data\n");
+	}
+
+	// leitura e escrita de um bloco em offsets aleatórios do arquivo
+	int nblocks_file = max(1L, size / Disk::DISK_BLOCK_SIZE);
+	char block[Disk::DISK_BLOCK_SIZE];
+	start(disk);
+	for(int i = 0; i < RANDOM_OPS; i++) {
+		fs.fs_read(inumber, block, Disk::DISK_BLOCK_SIZE, (rng() % nblocks_file) * Disk::DISK_BLOCK_SIZE);
+	}
+	stop(disk, "rand_read", RANDOM_OPS, (long)RANDOM_OPS * Disk::DISK_BLOCK_SIZE);
+
+	start(disk);
+	for(int i = 0; i < RANDOM_OPS; i++) {
+		fs.fs_write(inumber, block, Disk::DISK_BLOCK_SIZE, (rng() % nblocks_file) * Disk::DISK_BLOCK_SIZE);
+	}
+	fs.fs_sync();
+	stop(disk, "rand_write", RANDOM_OPS, (long)RANDOM_OPS * Disk::DISK_BLOCK_SIZE);
+	fs.fs_delete(inumber);
+
+	// copyin/copyout de um arquivo do host, como no shell
+	string host = image + ".host";
+	FILE *file = fopen(host.c_str(), "w");
+	fwrite(&data[0], 1, size, file);
+	fclose(file);
+
+	start(disk);
+	inumber = fs.fs_create();
+	file = fopen(host.c_str(), "r");
+	for(long off = 0; off < size; off += CHUNK) {
+		int n = fread(&back[0], 1, CHUNK, file);
+		fs.fs_write(inumber, &back[0], n, off);
+	}
+	fclose(file);
+	fs.fs_sync();
+	stop(disk, "copyin", (size + CHUNK - 1) / CHUNK, size);
+
+	start(disk);
+	file = fopen(host.c_str(), "w");
+	for(long off = 0; off < size; off += CHUNK) {
+		int n = fs.fs_read(inumber, &back[0], CHUNK, off);
+		fwrite(&back[0], 1, n, file);
+	}
+	fclose(file);
+	stop(disk, "copyout", (size + CHUNK - 1) / CHUNK, size);
+	unlink(host.c_str());
+	fs.fs_delete(inumber);
+
+	if(nthreads > 1) {
+		threads(fs, disk);
+	}
+
+	start(disk);
+	fs.fs_unmount();
+	stop(disk, "unmount", 1, 0);
+	disk.close();
+	unlink(image.c_str());
+}
+
+// nthreads threads criando, escrevendo, lendo de volta e apagando arquivos de
+// THREAD_FILE bytes ao mesmo tempo; conta as chamadas e os bytes de todas
+void Bench::threads(INE5412_FS &fs, Disk &disk)
+{
+	int iters = max(1, (file_mb << 20) / THREAD_FILE / nthreads);
+	mt19937 rng(2);
+	vector<char> data(THREAD_FILE);
+	vector<thread> workers;
+
+	for(int i = 0; i < THREAD_FILE; i++) {
+		data[i] = rng();
+	}
+
+	start(disk);
+	for(int id = 0; id < nthreads; id++) {
+		workers.push_back(thread([&fs, &data, iters]() {
+			vector<char> back(THREAD_FILE);
+			for(int i = 0; i < iters; i++) {
+				int inumber = fs.fs_create();
+				fs.fs_write(inumber, &data[0], THREAD_FILE, 0);
+				fs.fs_read(inumber, &back[0], THREAD_FILE, 0);
+				fs.fs_delete(inumber);
+			}
+		}));
+	}
+	for(size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	fs.fs_sync();
+	stop(disk, "threads_" + to_string(nthreads), 4L * nthreads * iters, 2L * nthreads * iters * THREAD_FILE);
+}
+
+// cargas numa cópia de uma imagem existente: mount/unmount e leitura de todos os arquivos
+void Bench::run_image(const char *filename)
+{
+	FILE *in = fopen(filename, "r");
+	if(!in) {
+		fprintf(stderr, "ERROR: couldn't open %s\n", filename);
+		return;
+	}
+	string copy = image + ".copy";
+	FILE *out = fopen(copy.c_str(), "w");
+	vector<char> buffer(CHUNK);
+	long size = 0;
+	int n;
+	while((n = fread(&buffer[0], 1, CHUNK, in)) > 0) {
+		fwrite(&buffer[0], 1, n, out);
+		size += n;
+	}
+	fclose(in);
+	fclose(out);
+
+	string name = filename;
+	name = name.substr(name.find_last_of('/') + 1);
+	Disk disk(copy.c_str(), size / Disk::DISK_BLOCK_SIZE, backend, queue_depth, direct);
+	INE5412_FS fs(&disk);
+
+	start(disk);
+	for(int i = 0; i < MOUNT_OPS; i++) {
+		fs.fs_mount();
+		fs.fs_unmount();
+	}
+	stop(disk, "mount " + name, MOUNT_OPS, 0);
+
+	// lê o superbloco para saber quantos inodes percorrer
+	union INE5412_FS::fs_block block;
+	disk.read(0, block.data);
+	int ninodes = block.super.ninodes;
+
+	fs.fs_mount();
+	long bytes = 0;
+	int files = 0;
+	start(disk);
+	for(int inumber = 1; inumber <= ninodes; inumber++) {
+		int length = fs.fs_getsize(inumber);
+		if(length < 0) {
+			continue;
+		}
+		vector<char> data(length);
+		bytes += fs.fs_read(inumber, &data[0], length, 0);
+		files++;
+	}
+	stop(disk, "read_all " + name, files, bytes);
+	fs.fs_unmount();
+	disk.close();
+	unlink(copy.c_str());
+}
+
+// imprime os resultados como tabela, CSV ou JSON
+void Bench::print(const char *format)
+{
+	if(!strcmp(format, "csv")) {
+		printf("workload,seconds,ops,ops_per_sec,mb_per_sec,disk_reads,disk_writes\n");
+	} else if(!strcmp(format, "json")) {
+		printf("[\n");
+	} else {
+		printf("%-20s %10s %10s %12s %10s %10s %10s\n", "workload", "seconds", "ops", "ops/s", "MB/s", "reads", "writes");
+	}
+
+	for(size_t i = 0; i < results.size(); i++) {
+		result &r = results[i];
+		double ops_s = r.seconds > 0 ? r.ops / r.seconds : 0;
+		double mb_s = r.seconds > 0 ? r.bytes / r.seconds / (1 << 20) : 0;
+
+		if(!strcmp(format, "csv")) {
+			printf("%s,%.6f,%ld,%.1f,%.2f,%ld,%ld\n", r.name.c_str(), r.seconds, r.ops, ops_s, mb_s, r.reads, r.writes);
+		} else if(!strcmp(format, "json")) {
+			printf("  {\"workload\": \"%s\", \"seconds\": %.6f, \"ops\": %ld, \"ops_per_sec\": %.1f, "
+			       "\"mb_per_sec\": %.2f, \"disk_reads\": %ld, \"disk_writes\": %ld}%s\n",
+			       r.name.c_str(), r.seconds, r.ops, ops_s, mb_s, r.reads, r.writes, i + 1 < results.size() ? "," : "");
+		} else {
+			printf("%-20s %10.4f %10ld %12.1f %10.2f %10ld %10ld\n", r.name.c_str(), r.seconds, r.ops, ops_s, mb_s, r.reads, r.writes);
+		}
+	}
+
+	if(!strcmp(format, "json")) {
+		printf("]\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Bench bench;
+	const char *format = "text";
+	bool bad_args = false;
+	int opt;
+
+	// -m/-u/-q/-d: backend do Disk, como no shell (compare, por exemplo, -u -q 1 com -u -q 32)
+	// -o text|csv|json: formato da saída
+	// -n: blocos da imagem nova; -s: MB dos arquivos; -c: inodes do create/delete
+	// -t: threads da carga com threads (1 = sem ela); -i: caminho da imagem nova
+	// -f pointers|extents|indirect: formato dos inodes da imagem nova
+	while((opt = getopt(argc, argv, "muq:do:n:s:c:t:i:f:")) != -1) {
+		if(opt == 'm') {
+			bench.backend = Disk::BACKEND_MMAP;
+		} else if(opt == 'u') {
+			bench.backend = Disk::BACKEND_URING;
+		} else if(opt == 'q') {
+			bench.queue_depth = atoi(optarg);
+		} else if(opt == 'd') {
+			bench.direct = true;
+		} else if(opt == 'o') {
+			format = optarg;
+		} else if(opt == 'n') {
+			bench.nblocks = atoi(optarg);
+		} else if(opt == 's') {
+			bench.file_mb = atoi(optarg);
+		} else if(opt == 'c') {
+			bench.nfiles = atoi(optarg);
+		} else if(opt == 't') {
+			bench.nthreads = atoi(optarg);
+		} else if(opt == 'i') {
+			bench.image = optarg;
+		} else if(opt == 'f' && !strcmp(optarg, "pointers")) {
+			bench.layout = 0;
+		} else if(opt == 'f' && !strcmp(optarg, "extents")) {
+			bench.layout = INE5412_FS::FORMAT_EXTENTS;
+		} else if(opt == 'f' && !strcmp(optarg, "indirect")) {
+			bench.layout = INE5412_FS::FORMAT_INDIRECT;
+		} else {
+			bad_args = true;
+		}
+	}
+
+	if(bad_args || bench.file_mb < 1 || (long)bench.file_mb * 2 * 256 + 4096 > bench.nblocks) {
+		cout << "use: " << argv[0] << " [-m | -u [-q depth] [-d]] [-o text|csv|json] [-f pointers|extents|indirect]"
+		     << " [-n nblocks] [-s MB]"
+		     << " [-c files] [-t threads] [-i image] [existing images...]\n";
+		return 1;
+	}
+
+	// as mensagens do fs e do Disk não se misturam com os resultados
+	streambuf *out = cout.rdbuf(0);
+	streambuf *err = cerr.rdbuf(0);
+
+	bench.run_fresh();
+	if(optind == argc) {
+		const char *images[] = { "image.5", "image.20", "image.200" };
+		for(int i = 0; i < 3; i++) {
+			if(access(images[i], R_OK) == 0) {
+				bench.run_image(images[i]);
+			}
+		}
+	}
+	for(int i = optind; i < argc; i++) {
+		bench.run_image(argv[i]);
+	}
+
+	cout.rdbuf(out);
+	cerr.rdbuf(err);
+	bench.print(format);
+	return 0;
+}
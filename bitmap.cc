@@ -0,0 +1,155 @@
+#include "bitmap.h"
+
+// ajusta o tamanho e deixa todos os bits livres
+void Bitmap::resize(int n)
+{
+    nbits = n < 0 ? 0 : n;
+    words.assign((nbits + BITS_PER_WORD - 1) / BITS_PER_WORD, 0);
+
+    // os bits depois do fim ficam ocupados, assim as buscas nunca passam do tamanho
+    if (nbits % BITS_PER_WORD) {
+        words.back() = ~0ULL << (nbits % BITS_PER_WORD);
+    }
+    nfree = nbits;
+}
+
+void Bitmap::set(int i)
+{
+    uint64_t mask = 1ULL << (i % BITS_PER_WORD);
+    uint64_t &w = words[i / BITS_PER_WORD];
+    if (!(w & mask)) {
+        w |= mask;
+        nfree--;
+    }
+}
+
+void Bitmap::clear(int i)
+{
+    uint64_t mask = 1ULL << (i % BITS_PER_WORD);
+    uint64_t &w = words[i / BITS_PER_WORD];
+    if (w & mask) {
+        w &= ~mask;
+        nfree++;
+    }
+}
+
+// recalcula o contador de livres depois de alterar as palavras diretamente
+void Bitmap::recount()
+{
+    if (nbits % BITS_PER_WORD) {
+        words.back() |= ~0ULL << (nbits % BITS_PER_WORD);
+    }
+
+    int used = 0;
+    for (std::size_t i = 0; i < words.size(); i++) {
+        used += __builtin_popcountll(words[i]);
+    }
+    nfree = (int)words.size() * BITS_PER_WORD - used;
+}
+
+// marca como ocupados os bits ocupados em other, que deve ter o mesmo tamanho.
+// O laço palavra a palavra, sem dependências, é vetorizado pelo compilador
+void Bitmap::merge(const Bitmap &other)
+{
+    uint64_t *dst = &words[0];
+    const uint64_t *src = &other.words[0];
+    std::size_t n = words.size() < other.words.size() ? words.size() : other.words.size();
+
+    for (std::size_t i = 0; i < n; i++) {
+        dst[i] |= src[i];
+    }
+    recount();
+}
+
+// retorna o primeiro bit livre a partir de from, ou -1
+int Bitmap::find_first_free(int from)
+{
+    if (from < 0) {
+        from = 0;
+    }
+    if (from >= nbits || nfree == 0) {
+        return -1;
+    }
+
+    std::size_t wi = from / BITS_PER_WORD;
+    uint64_t freebits = ~words[wi] & (~0ULL << (from % BITS_PER_WORD));
+
+    while (!freebits) {
+        if (++wi == words.size()) {
+            return -1;
+        }
+        freebits = ~words[wi];
+    }
+    return wi * BITS_PER_WORD + __builtin_ctzll(freebits);
+}
+
+// retorna o início da primeira sequência de n bits livres a partir de from, ou -1
+int Bitmap::find_free_run(int n, int from)
+{
+    if (from < 0) {
+        from = 0;
+    }
+    if (n <= 0 || n > nfree || from >= nbits) {
+        return -1;
+    }
+
+    int run_start = -1, run_len = 0;
+
+    for (std::size_t wi = from / BITS_PER_WORD; wi < words.size(); wi++) {
+        uint64_t used = words[wi];
+        if (wi == (std::size_t)from / BITS_PER_WORD) {
+            used |= (1ULL << (from % BITS_PER_WORD)) - 1;  // ignora os bits antes de from
+        }
+
+        // palavra toda ocupada ou toda livre, trata de uma vez
+        if (used == ~0ULL) {
+            run_len = 0;
+            continue;
+        }
+        if (used == 0) {
+            if (run_len == 0) {
+                run_start = wi * BITS_PER_WORD;
+            }
+            run_len += BITS_PER_WORD;
+            if (run_len >= n) {
+                return run_start;
+            }
+            continue;
+        }
+
+        // percorre a palavra pulando sequências de bits iguais com ctz
+        int bit = 0;
+        while (bit < BITS_PER_WORD) {
+            uint64_t rest = used >> bit;
+            if (bit) {
+                rest |= ~0ULL << (BITS_PER_WORD - bit);
+            }
+
+            if (rest & 1) {
+                run_len = 0;
+                bit += ~rest ? __builtin_ctzll(~rest) : BITS_PER_WORD - bit;
+            } else {
+                int zeros = __builtin_ctzll(rest);
+                if (run_len == 0) {
+                    run_start = wi * BITS_PER_WORD + bit;
+                }
+                run_len += zeros;
+                if (run_len >= n) {
+                    return run_start;
+                }
+                bit += zeros;
+            }
+        }
+    }
+    return -1;
+}
+
+// retorna o bit livre mais próximo depois de hint, dando a volta no início se preciso
+int Bitmap::find_free_near(int hint)
+{
+    int b = find_first_free(hint);
+    if (b < 0) {
+        b = find_first_free(0);
+    }
+    return b;
+}
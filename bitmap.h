@@ -0,0 +1,37 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <vector>
+
+// bitmap de 1 bit por bloco (1 = ocupado), guardado em palavras de 64 bits
+class Bitmap
+{
+public:
+    static const int BITS_PER_WORD = 64;
+
+    Bitmap(int nbits = 0) { resize(nbits); }
+
+    void resize(int nbits);
+    int  size() { return nbits; }
+    int  count_free() { return nfree; }
+
+    bool test(int i) { return (words[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1; }
+    void set(int i);
+    void clear(int i);
+
+    int  find_first_free(int from = 0);
+    int  find_free_run(int n, int from = 0);
+    int  find_free_near(int hint);
+
+    std::vector<uint64_t> &raw() { return words; }
+    void recount();
+    void merge(const Bitmap &other);
+
+private:
+    std::vector<uint64_t> words;
+    int nbits;
+    int nfree;  // n de bits livres, mantido a cada set/clear
+};
+
+#endif
@@ -0,0 +1,348 @@
+#include "cache.h"
+#include <cstring>
+
+Block_Cache::Block_Cache(Disk *d, int cap, Policy p)
+{
+    disk = d;
+    policy = p;
+    capacity = cap < 1 ? 1 : cap;
+    nused = 0;
+    hand = 0;
+    lru_head = -1;
+    lru_tail = -1;
+    nhits = 0;
+    nmisses = 0;
+    nreadahead = 0;
+
+    slots.resize(capacity);
+    buffer.resize((size_t)capacity * Disk::DISK_BLOCK_SIZE);
+
+    for (int i = 0; i < capacity; i++) {
+        slots[i].blocknum = -1;
+        slots[i].dirty = false;
+        slots[i].ref = false;
+        slots[i].pins = 0;
+        slots[i].prev = -1;
+        slots[i].next = -1;
+    }
+}
+
+// procura o bloco no cache, retorna o slot ou -1
+int Block_Cache::lookup(int blocknum)
+{
+    std::unordered_map<int, int>::iterator it = index.find(blocknum);
+    if (it == index.end()) {
+        return -1;
+    }
+    return it->second;
+}
+
+void Block_Cache::lru_unlink(int slot)
+{
+    cache_slot &s = slots[slot];
+
+    if (s.prev != -1) slots[s.prev].next = s.next;
+    else lru_head = s.next;
+
+    if (s.next != -1) slots[s.next].prev = s.prev;
+    else lru_tail = s.prev;
+
+    s.prev = s.next = -1;
+}
+
+void Block_Cache::lru_push_front(int slot)
+{
+    slots[slot].prev = -1;
+    slots[slot].next = lru_head;
+
+    if (lru_head != -1) slots[lru_head].prev = slot;
+    lru_head = slot;
+
+    if (lru_tail == -1) lru_tail = slot;
+}
+
+// marca o slot como usado recentemente
+void Block_Cache::touch(int slot)
+{
+    if (policy == CLOCK) {
+        slots[slot].ref = true;
+    } else if (lru_head != slot) {
+        lru_unlink(slot);
+        lru_push_front(slot);
+    }
+}
+
+// escreve o slot no disco se estiver sujo
+void Block_Cache::writeback(int slot)
+{
+    if (slots[slot].dirty) {
+        disk->write(slots[slot].blocknum, slot_data(slot));
+        slots[slot].dirty = false;
+    }
+}
+
+// escolhe o slot a ser substituido conforme a politica, pulando os slots
+// presos. Se todos estiverem presos, substitui um deles assim mesmo
+int Block_Cache::choose_victim()
+{
+    if (policy == LRU) {
+        for (int slot = lru_tail; slot != -1; slot = slots[slot].prev) {
+            if (!slots[slot].pins) {
+                return slot;
+            }
+        }
+        return lru_tail;
+    }
+
+    // CLOCK: avanca o ponteiro ate achar um slot sem bit de referencia e sem
+    // pins. Em duas voltas todos os bits de referencia já foram limpos
+    for (int i = 0; i < 2 * capacity && (slots[hand].ref || slots[hand].pins); i++) {
+        slots[hand].ref = false;
+        hand = (hand + 1) % capacity;
+    }
+    int victim = hand;
+    hand = (hand + 1) % capacity;
+    return victim;
+}
+
+// reserva um slot para o bloco, despejando outro se o cache estiver cheio
+int Block_Cache::allocate(int blocknum)
+{
+    int slot;
+
+    if (nused < capacity) {
+        slot = nused++;
+    } else {
+        slot = choose_victim();
+        writeback(slot);
+        index.erase(slots[slot].blocknum);
+        if (policy == LRU) {
+            lru_unlink(slot);
+        }
+    }
+
+    slots[slot].blocknum = blocknum;
+    slots[slot].dirty = false;
+    slots[slot].ref = true;
+    if (policy == LRU) {
+        lru_push_front(slot);
+    }
+    index[blocknum] = slot;
+    return slot;
+}
+
+void Block_Cache::read(int blocknum, char *data)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int slot = lookup(blocknum);
+
+    if (slot != -1) {
+        nhits++;
+        touch(slot);
+    } else {
+        nmisses++;
+        slot = allocate(blocknum);
+        disk->read(blocknum, slot_data(slot));
+    }
+
+    memcpy(data, slot_data(slot), Disk::DISK_BLOCK_SIZE);
+}
+
+void Block_Cache::write(int blocknum, const char *data)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int slot = lookup(blocknum);
+
+    // o bloco inteiro e sobrescrito, entao nao precisa ler do disco
+    if (slot != -1) {
+        nhits++;
+        touch(slot);
+    } else {
+        nmisses++;
+        slot = allocate(blocknum);
+    }
+
+    memcpy(slot_data(slot), data, Disk::DISK_BLOCK_SIZE);
+    slots[slot].dirty = true;
+}
+
+// lê uma lista de blocos. Os que estão no cache são copiados de lá, os outros
+// são lidos do disco direto para o buffer do chamador, numa leitura vetorizada,
+// sem ocupar o cache. Os blocos de ahead (readahead) que não estiverem no cache
+// são carregados nele numa leitura vetorizada separada
+void Block_Cache::read_blocks(std::vector<Disk::block_io> &ios, const std::vector<int> &ahead)
+{
+    std::vector<Disk::block_io> missing;
+    std::vector<Disk::block_io> direct;
+    std::unique_lock<std::mutex> guard(lock);
+
+    // no máximo metade do cache vai para readahead, para não expulsar os metadados
+    for (std::size_t i = 0; i < ahead.size() && (int)i < capacity / 2; i++) {
+        if (lookup(ahead[i]) == -1) {
+            Disk::block_io io;
+            io.blocknum = ahead[i];
+            io.data = slot_data(allocate(ahead[i]));
+            missing.push_back(io);
+            nreadahead++;
+        }
+    }
+
+    // os acertos não renovam o slot: um bloco de dados já consumido deve sair
+    // do cache antes dos blocos carregados adiante que ainda não foram lidos
+    for (std::size_t i = 0; i < ios.size(); i++) {
+        int slot = lookup(ios[i].blocknum);
+        if (slot != -1) {
+            nhits++;
+            memcpy(ios[i].data, slot_data(slot), Disk::DISK_BLOCK_SIZE);
+        } else {
+            nmisses++;
+            direct.push_back(ios[i]);
+        }
+    }
+
+    // os slots do readahead só podem ser vistos por outras threads depois de lidos.
+    // Os blocos que vão para o buffer do chamador são lidos fora do lock
+    disk->read_blocks(missing);
+    guard.unlock();
+    disk->read_blocks(direct);
+}
+
+// escreve uma lista de blocos direto no disco, numa escrita vetorizada. As cópias
+// que estiverem no cache são atualizadas e deixam de estar sujas
+void Block_Cache::write_blocks(std::vector<Disk::block_io> &ios)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::size_t i = 0; i < ios.size(); i++) {
+        int slot = lookup(ios[i].blocknum);
+        if (slot != -1) {
+            nhits++;
+            memcpy(slot_data(slot), ios[i].data, Disk::DISK_BLOCK_SIZE);
+            slots[slot].dirty = false;
+        } else {
+            nmisses++;
+        }
+    }
+
+    disk->write_blocks(ios);
+}
+
+// escreve count blocos consecutivos direto no disco
+void Block_Cache::write_blocks(int blocknum, int count, const char *data)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int i = 0; i < count; i++) {
+        int slot = lookup(blocknum + i);
+        if (slot != -1) {
+            memcpy(slot_data(slot), data + (size_t)i * Disk::DISK_BLOCK_SIZE, Disk::DISK_BLOCK_SIZE);
+            slots[slot].dirty = false;
+        }
+    }
+
+    disk->write_blocks(blocknum, count, data);
+}
+
+// escreve todos os blocos sujos no disco, juntando os blocos consecutivos
+void Block_Cache::flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Disk::block_io> ios;
+
+    for (int i = 0; i < nused; i++) {
+        if (slots[i].dirty) {
+            Disk::block_io io;
+            io.blocknum = slots[i].blocknum;
+            io.data = slot_data(i);
+            ios.push_back(io);
+            slots[i].dirty = false;
+        }
+    }
+
+    disk->write_blocks(ios);
+}
+
+// retorna um ponteiro só de leitura para o bloco dentro do cache, válido até a
+// próxima operação no cache. Com pin, o slot fica preso e o ponteiro vale até o
+// unpin. Se o bloco não estiver lá, lê do disco quando load for verdadeiro,
+// senão retorna 0
+const char *Block_Cache::pointer(int blocknum, bool load, bool pin)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int slot = lookup(blocknum);
+
+    if (slot != -1) {
+        nhits++;
+        touch(slot);
+    } else if (load) {
+        nmisses++;
+        slot = allocate(blocknum);
+        disk->read(blocknum, slot_data(slot));
+    } else {
+        return 0;
+    }
+    if (pin) {
+        slots[slot].pins++;
+    }
+    return slot_data(slot);
+}
+
+// solta os slots presos pelo pointer cobertos por [data, data + length). Os
+// ponteiros que não são do cache são ignorados
+void Block_Cache::unpin(const char *data, int length)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const char *base = &buffer[0];
+    if (length <= 0 || data < base || data >= base + buffer.size()) {
+        return;
+    }
+
+    int first = (data - base) / Disk::DISK_BLOCK_SIZE;
+    int last = (data + length - 1 - base) / Disk::DISK_BLOCK_SIZE;
+    for (int slot = first; slot <= last && slot < capacity; slot++) {
+        if (slots[slot].pins) {
+            slots[slot].pins--;
+        }
+    }
+}
+
+// descarta os blocos do cache sem gravá-los e zera a faixa no disco (ver
+// Disk::discard). Os slots liberados viram os próximos a serem substituídos
+bool Block_Cache::discard(int blocknum, int count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int i = 0; i < count; i++) {
+        int slot = lookup(blocknum + i);
+        if (slot == -1) {
+            continue;
+        }
+        index.erase(blocknum + i);
+        slots[slot].blocknum = -1;
+        slots[slot].dirty = false;
+        slots[slot].ref = false;
+        // um slot preso continua com os dados antigos até o unpin
+        if (policy == LRU && lru_tail != slot) {
+            lru_unlink(slot);
+            slots[slot].prev = lru_tail;
+            slots[lru_tail].next = slot;
+            lru_tail = slot;
+        }
+    }
+
+    return disk->discard(blocknum, count);
+}
+
+// escreve um único bloco no disco, se estiver sujo no cache
+void Block_Cache::sync(int blocknum)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int slot = lookup(blocknum);
+    if (slot != -1) {
+        writeback(slot);
+    }
+}
+
+void Block_Cache::close()
+{
+    flush();
+    cout << nhits << " cache hits\n";
+    cout << nmisses << " cache misses\n";
+}
@@ -0,0 +1,77 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// cache de blocos write-back entre o INE5412_FS e o Disk. Pode ser usado por
+// várias threads: cada operação segura o lock do cache, menos as leituras do
+// disco direto para o buffer do chamador
+class Block_Cache
+{
+public:
+    static const int DEFAULT_CAPACITY = 64;
+
+    enum Policy { LRU, CLOCK };
+
+    Block_Cache(Disk *d, int capacity = DEFAULT_CAPACITY, Policy policy = LRU);
+
+    void read(int blocknum, char *data);
+    void write(int blocknum, const char *data);
+    void read_blocks(std::vector<Disk::block_io> &ios, const std::vector<int> &ahead = std::vector<int>());
+    void write_blocks(std::vector<Disk::block_io> &ios);
+    void write_blocks(int blocknum, int count, const char *data);
+    void flush();
+    void sync(int blocknum);
+    bool discard(int blocknum, int count);
+    const char *pointer(int blocknum, bool load, bool pin = false);
+    void unpin(const char *data, int length);
+    void close();
+
+    long hits() { return nhits; }
+    long misses() { return nmisses; }
+    long readaheads() { return nreadahead; }
+    int  size() { return capacity; }
+    void reset_counters() { nhits = 0; nmisses = 0; nreadahead = 0; }
+
+private:
+    class cache_slot {
+        public:
+            int blocknum;   // bloco do disco guardado no slot (-1 se vazio)
+            bool dirty;     // bloco alterado e ainda nao escrito no disco
+            bool ref;       // bit de referencia do CLOCK
+            int pins;       // ponteiros do pointer ainda em uso; o slot nao e substituido enquanto houver
+            int prev;       // vizinhos na lista LRU
+            int next;
+    };
+
+    int lookup(int blocknum);
+    int allocate(int blocknum);
+    int choose_victim();
+    void touch(int slot);
+    void lru_unlink(int slot);
+    void lru_push_front(int slot);
+    void writeback(int slot);
+    char *slot_data(int slot) { return &buffer[(size_t)slot * Disk::DISK_BLOCK_SIZE]; }
+
+private:
+    Disk *disk;
+    Policy policy;
+    int capacity;
+    int nused;
+    int hand;       // ponteiro do CLOCK
+    int lru_head;   // mais recente
+    int lru_tail;   // menos recente
+    std::atomic<long> nhits;
+    std::atomic<long> nmisses;
+    std::atomic<long> nreadahead;    // blocos carregados antecipadamente pelo read_blocks
+    std::vector<cache_slot> slots;
+    std::vector<char> buffer;
+    std::unordered_map<int, int> index;    // blocknum -> slot
+    std::mutex lock;
+};
+
+#endif
@@ -1,23 +1,95 @@
 #include "disk.h"
+#include "uring.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <limits.h>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-Disk::Disk(const char *filename, int n)
+Disk::Disk(const char *filename, int n, Backend b, int queue_depth, bool direct)
 {
-	diskfile = fopen(filename, "r+");
+	backend = b;
+	map = 0;
+	uring = 0;
 
-	if(!diskfile) 
-		diskfile = fopen(filename, "w+");
+	// O_DIRECT só faz sentido com a fila assíncrona, que tem buffers alinhados
+	direct = direct && backend == BACKEND_URING;
+	fd = open(filename, O_RDWR | O_CREAT | (direct ? O_DIRECT : 0), 0666);
+	if(fd < 0 && direct) {
+		cout << "WARNING: O_DIRECT not supported for " << filename << "\n";
+		direct = false;
+		fd = open(filename, O_RDWR | O_CREAT, 0666);
+	}
 
-	if(!diskfile) { 
+	if(fd < 0) { 
 		cout << "Error when opening the file " << filename << "\n";
 		return;
 	}
 
-	ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+	ftruncate(fd, (off_t)n * DISK_BLOCK_SIZE);
+
+	// mapeia a imagem inteira; se não der, volta para pread/pwrite
+	if(backend == BACKEND_MMAP && n > 0) {
+		void *p = mmap(0, (size_t)n * DISK_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED) {
+			cout << "WARNING: couldn't map " << filename << ", using pread/pwrite\n";
+			backend = BACKEND_PREAD;
+		} else {
+			map = (char *)p;
+		}
+	}
+
+	// cria a fila do io_uring; se o kernel não suportar, volta para pread/pwrite
+	if(backend == BACKEND_URING) {
+		uring = new IO_Uring(fd, DISK_BLOCK_SIZE, queue_depth, direct);
+		if(!uring->ok()) {
+			cout << "WARNING: io_uring not available, using pread/pwrite\n";
+			delete uring;
+			uring = 0;
+			backend = BACKEND_PREAD;
+		}
+	}
 
     nblocks = n;
-    nreads = 0;
-    nwrites = 0;
+    types.assign(n > 0 ? n : 0, BLOCK_DATA);
+    reset_counters();
+}
+
+const char *Disk::type_name(int type)
+{
+	static const char *names[BLOCK_TYPES] = { "data", "super", "inode", "bitmap", "journal", "indirect" };
+	return names[type];
+}
+
+// marca count blocos a partir de blocknum como do tipo type, para os contadores
+void Disk::set_type(int blocknum, int count, Block_Type type)
+{
+	for(int i = max(blocknum, 0); i < blocknum + count && i < nblocks; i++) {
+		__atomic_store_n(&types[i], (unsigned char)type, __ATOMIC_RELAXED);
+	}
+}
+
+void Disk::reset_counters()
+{
+	nreads = 0;
+	nwrites = 0;
+	for(int t = 0; t < BLOCK_TYPES; t++) {
+		type_reads[t] = 0;
+		type_writes[t] = 0;
+	}
+}
+
+// conta n blocos consecutivos lidos ou escritos a partir de blocknum
+void Disk::tally(int blocknum, int n, bool writing)
+{
+	std::atomic<long> *per_type = writing ? type_writes : type_reads;
+
+	(writing ? nwrites : nreads) += n;
+	for(int i = 0; i < n; i++) {
+		per_type[__atomic_load_n(&types[blocknum + i], __ATOMIC_RELAXED)]++;
+	}
 }
 
 int Disk::size()
@@ -47,10 +119,14 @@ void Disk::read(int blocknum, char *data )
 {
 	sanity_check(blocknum, data);
 
-    fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
-
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	if(map) {
+		memcpy(data, map + (size_t)blocknum * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+		tally(blocknum, 1, false);
+	} else if(uring) {
+		submit_read(blocknum, data);
+		complete();
+	} else if(pread(fd, data, DISK_BLOCK_SIZE, (off_t)blocknum * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE) {
+		tally(blocknum, 1, false);
 	} else {
 		cout << "ERROR: couldn't access simulated disk\n";
 		abort();
@@ -61,10 +137,14 @@ void Disk::write(int blocknum, const char *data)
 {
 	sanity_check(blocknum, data);
 
-    fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(map) {
+		memcpy(map + (size_t)blocknum * DISK_BLOCK_SIZE, data, DISK_BLOCK_SIZE);
+		tally(blocknum, 1, true);
+	} else if(uring) {
+		submit_write(blocknum, data);
+		complete();
+	} else if(pwrite(fd, data, DISK_BLOCK_SIZE, (off_t)blocknum * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE) {
+		tally(blocknum, 1, true);
 	} else {
 		cout << "ERROR: couldn't access simulated disk\n";
 		abort();
@@ -72,13 +152,236 @@ void Disk::write(int blocknum, const char *data)
 	
 }
 
+// lê count blocos consecutivos a partir de blocknum com uma única chamada
+void Disk::read_blocks(int blocknum, int count, char *data)
+{
+	if(count <= 0) return;
+	sanity_check(blocknum, data);
+	sanity_check(blocknum + count - 1, data);
+
+	size_t total = (size_t)count * DISK_BLOCK_SIZE;
+	size_t done = 0;
+	if(map) {
+		memcpy(data, map + (size_t)blocknum * DISK_BLOCK_SIZE, total);
+		done = total;
+	} else if(uring) {
+		for(int i = 0; i < count; i++) {
+			submit_read(blocknum + i, data + (size_t)i * DISK_BLOCK_SIZE);
+		}
+		complete();
+		return;
+	}
+	while(done < total) {
+		ssize_t r = pread(fd, data + done, total - done, (off_t)blocknum * DISK_BLOCK_SIZE + done);
+		if(r <= 0) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+		done += r;
+	}
+	tally(blocknum, count, false);
+}
+
+// escreve count blocos consecutivos a partir de blocknum com uma única chamada
+void Disk::write_blocks(int blocknum, int count, const char *data)
+{
+	if(count <= 0) return;
+	sanity_check(blocknum, data);
+	sanity_check(blocknum + count - 1, data);
+
+	size_t total = (size_t)count * DISK_BLOCK_SIZE;
+	size_t done = 0;
+	if(map) {
+		memcpy(map + (size_t)blocknum * DISK_BLOCK_SIZE, data, total);
+		done = total;
+	} else if(uring) {
+		for(int i = 0; i < count; i++) {
+			submit_write(blocknum + i, data + (size_t)i * DISK_BLOCK_SIZE);
+		}
+		complete();
+		return;
+	}
+	while(done < total) {
+		ssize_t r = pwrite(fd, data + done, total - done, (off_t)blocknum * DISK_BLOCK_SIZE + done);
+		if(r <= 0) {
+			cout << "ERROR: couldn't access simulated disk\n";
+			abort();
+		}
+		done += r;
+	}
+	tally(blocknum, count, true);
+}
+
+static bool block_io_less(const Disk::block_io &a, const Disk::block_io &b)
+{
+	return a.blocknum < b.blocknum;
+}
+
+// lê uma lista de blocos, juntando os blocos fisicamente consecutivos numa única preadv
+void Disk::read_blocks(std::vector<block_io> &ios)
+{
+	transfer(ios, false);
+}
+
+// escreve uma lista de blocos, juntando os blocos fisicamente consecutivos numa única pwritev
+void Disk::write_blocks(std::vector<block_io> &ios)
+{
+	transfer(ios, true);
+}
+
+void Disk::transfer(std::vector<block_io> &ios, bool writing)
+{
+	// com a imagem mapeada cada bloco é só uma cópia de memória
+	if(map) {
+		for(std::size_t i = 0; i < ios.size(); i++) {
+			if(writing) write(ios[i].blocknum, ios[i].data);
+			else read(ios[i].blocknum, ios[i].data);
+		}
+		return;
+	}
+
+	// com a fila assíncrona, todos os blocos ficam em andamento ao mesmo tempo
+	if(uring) {
+		for(std::size_t i = 0; i < ios.size(); i++) {
+			if(writing) submit_write(ios[i].blocknum, ios[i].data);
+			else submit_read(ios[i].blocknum, ios[i].data);
+		}
+		complete();
+		return;
+	}
+
+	std::stable_sort(ios.begin(), ios.end(), block_io_less);
+
+	std::vector<struct iovec> iov;
+	std::size_t i = 0;
+
+	while(i < ios.size()) {
+		sanity_check(ios[i].blocknum, ios[i].data);
+
+		// junta a sequência de blocos consecutivos que começa em ios[i]
+		std::size_t j = i + 1;
+		while(j < ios.size() && j - i < IOV_MAX && ios[j].blocknum == ios[j-1].blocknum + 1) {
+			sanity_check(ios[j].blocknum, ios[j].data);
+			j++;
+		}
+
+		iov.resize(j - i);
+		for(std::size_t k = i; k < j; k++) {
+			iov[k - i].iov_base = ios[k].data;
+			iov[k - i].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		off_t pos = (off_t)ios[i].blocknum * DISK_BLOCK_SIZE;
+		size_t total = (j - i) * DISK_BLOCK_SIZE;
+		ssize_t r = writing ? pwritev(fd, &iov[0], iov.size(), pos) : preadv(fd, &iov[0], iov.size(), pos);
+
+		// transferência parcial: termina bloco a bloco
+		if(r != (ssize_t)total) {
+			for(std::size_t k = i; k < j; k++) {
+				if(writing) write(ios[k].blocknum, ios[k].data);
+				else read(ios[k].blocknum, ios[k].data);
+			}
+		} else {
+			tally(ios[i].blocknum, j - i, writing);
+		}
+		i = j;
+	}
+}
+
+// coloca a leitura de um bloco na fila do io_uring, sem esperar terminar.
+// Nos outros backends lê na hora. O buffer só pode ser usado depois do complete()
+void Disk::submit_read(int blocknum, char *data)
+{
+	if(!uring) {
+		read(blocknum, data);
+		return;
+	}
+	sanity_check(blocknum, data);
+	uring->submit(blocknum, data, false);
+	tally(blocknum, 1, false);
+}
+
+// coloca a escrita de um bloco na fila do io_uring, sem esperar terminar.
+// O buffer não pode ser alterado antes do complete()
+void Disk::submit_write(int blocknum, const char *data)
+{
+	if(!uring) {
+		write(blocknum, data);
+		return;
+	}
+	sanity_check(blocknum, data);
+	uring->submit(blocknum, (char *)data, true);
+	tally(blocknum, 1, true);
+}
+
+// espera todas as requisições enviadas com submit_read/submit_write
+void Disk::complete()
+{
+	if(uring) {
+		uring->wait_all();
+	}
+}
+
+// retorna um ponteiro só de leitura para o bloco dentro da imagem mapeada,
+// ou 0 se o disco não estiver usando o BACKEND_MMAP. Conta como uma leitura
+const char *Disk::block_pointer(int blocknum)
+{
+	if(!map) return 0;
+
+	sanity_check(blocknum, map);
+	tally(blocknum, 1, false);
+	return map + (size_t)blocknum * DISK_BLOCK_SIZE;
+}
+
+// zera count blocos a partir de blocknum liberando o espaço no arquivo da
+// imagem, que fica esparso. Se o sistema de arquivos hospedeiro não souber
+// abrir buracos, tenta zerar a faixa sem escrever; retorna false se nenhum
+// dos dois funcionar, e aí os blocos ficam como estavam
+bool Disk::discard(int blocknum, int count)
+{
+	if(count <= 0) return true;
+
+	sanity_check(blocknum, this);
+	sanity_check(blocknum + count - 1, this);
+
+	complete();    // uma escrita em andamento não pode cair depois do buraco
+
+	off_t offset = (off_t)blocknum * DISK_BLOCK_SIZE;
+	off_t length = (off_t)count * DISK_BLOCK_SIZE;
+
+	if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+		return true;
+	}
+	return fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0;
+}
+
+// garante que as escritas feitas até aqui chegaram no arquivo da imagem
+void Disk::sync()
+{
+	complete();
+	if(map) {
+		msync(map, (size_t)nblocks * DISK_BLOCK_SIZE, MS_SYNC);
+	} else if(fd >= 0) {
+		fdatasync(fd);
+	}
+}
+
 void Disk::close()
 {
-	if(diskfile) {
+	if(fd >= 0) {
+		if(uring) {
+			delete uring;   // espera as requisições em andamento
+			uring = 0;
+		}
 		cout << nreads << " disk block reads\n";
 		cout << nwrites << " disk block writes\n";
-		fclose(diskfile);
-		diskfile = 0;
+		if(map) {
+			msync(map, (size_t)nblocks * DISK_BLOCK_SIZE, MS_SYNC);
+			munmap(map, (size_t)nblocks * DISK_BLOCK_SIZE);
+			map = 0;
+		}
+		::close(fd);
+		fd = -1;
 	}
 }
 
@@ -1,34 +1,80 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <stdio.h>
+#include <vector>
 
 using namespace std;
 
+class IO_Uring;
+
 class Disk
 {
 public:
     static const unsigned short int DISK_BLOCK_SIZE = 4096;
     static const unsigned int DISK_MAGIC = 0xdeadbeef;
+    static const int DEFAULT_QUEUE_DEPTH = 32;
+
+    // um bloco de uma operação vetorizada: número do bloco e buffer de DISK_BLOCK_SIZE bytes
+    class block_io {
+        public:
+            int blocknum;
+            char *data;
+    };
+
+    // como o arquivo da imagem é acessado
+    enum Backend { BACKEND_PREAD, BACKEND_MMAP, BACKEND_URING };
+
+    // tipo de um bloco, só para separar os contadores de leituras e escritas. O
+    // Disk não conhece o formato: quem usa o disco marca os blocos com set_type
+    enum Block_Type { BLOCK_DATA, BLOCK_SUPER, BLOCK_INODE, BLOCK_BITMAP, BLOCK_JOURNAL, BLOCK_INDIRECT, BLOCK_TYPES };
+    static const char *type_name(int type);
 
-    Disk(const char *filename, int nblocks);
+    Disk(const char *filename, int nblocks, Backend backend = BACKEND_PREAD,
+         int queue_depth = DEFAULT_QUEUE_DEPTH, bool direct = false);
 
     int size();
     void read(int blocknum, char * data);
     void write(int blocknum, const char * data);
+    void read_blocks(int blocknum, int count, char *data);
+    void write_blocks(int blocknum, int count, const char *data);
+    void read_blocks(std::vector<block_io> &ios);
+    void write_blocks(std::vector<block_io> &ios);
+    void submit_read(int blocknum, char *data);
+    void submit_write(int blocknum, const char *data);
+    void complete();
+    const char *block_pointer(int blocknum);
+    bool mapped() { return map != 0; }
+    long reads() { return nreads; }
+    long writes() { return nwrites; }
+    long reads(int type) { return type_reads[type]; }
+    long writes(int type) { return type_writes[type]; }
+    void set_type(int blocknum, int count, Block_Type type);
+    void reset_counters();
+    bool discard(int blocknum, int count);
+    void sync();
     void close();
 
 private:
     void sanity_check(int blocknum, const void *data);
+    void transfer(std::vector<block_io> &ios, bool writing);
+    void tally(int blocknum, int n, bool writing);
 
 private:
-    FILE *diskfile;
+    int fd;
+    Backend backend;
+    char *map;  // imagem mapeada na memória (só no BACKEND_MMAP)
+    IO_Uring *uring;    // fila assíncrona (só no BACKEND_URING)
     int nblocks;
-    int nreads;
-    int nwrites;
+    std::atomic<long> nreads;   // as transferências usam pread/pwrite com offset, sem
+    std::atomic<long> nwrites;  // posição compartilhada, e podem vir de várias threads
+    std::atomic<long> type_reads[BLOCK_TYPES];
+    std::atomic<long> type_writes[BLOCK_TYPES];
+    std::vector<unsigned char> types;   // Block_Type de cada bloco, lido e escrito com __atomic
 };
 
 
-#endif
\ No newline at end of file
+#endif
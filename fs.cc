@@ -1,7 +1,17 @@
 #include "fs.h"
+#include <algorithm>
+#include <limits.h>
 #include <math.h>
-
-int INE5412_FS::fs_format()
+#include <thread>
+
+// formata o disco. Com FORMAT_FAST, em vez de escrever zeros, abre buracos na
+// imagem no lugar da tabela de inodes e dos dados, e a tabela de inodes é
+// inicializada aos poucos, conforme os inodes são gravados. Com FORMAT_EXTENTS
+// os inodes guardam extents em vez de ponteiros para cada bloco, e com
+// FORMAT_INDIRECT têm blocos duplo e triplo indireto para arquivos grandes.
+// Com FORMAT_INLINE, arquivos de até INLINE_SIZE bytes ficam dentro do inode.
+// Se houver espaço, reserva depois dos bitmaps o journal dos metadados
+int INE5412_FS::fs_format(int flags)
 {
     //  verifica se esta montado
     if (mounted) {
@@ -10,59 +20,145 @@ int INE5412_FS::fs_format()
     }
 
 	union fs_block block;
-	disk->read(0, block.data);  // lê o superbloco
+	memset(block.data, 0, Disk::DISK_BLOCK_SIZE);
 
+	bool fast = flags & FORMAT_FAST;
+	if ((flags & FORMAT_EXTENTS) && (flags & FORMAT_INDIRECT)) {
+		cerr << "ERROR: extents and indirect formats are exclusive" << endl;
+		return 0;
+	}
 	int nblocks = disk->size();  // pega o tamanho dos blocos
 	int ninodeblocks = ceil(nblocks*0.1);   // calcula o n de blocos de inode, pegando 10% do tamanho dos blocos e arredondando para cima
 	int ninodes = ninodeblocks*INODES_PER_BLOCK;    // calcula o n de inodes
+	int nbitmapblocks = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;  // blocos do bitmap de blocos livres
+	int ninodemapblocks = (ninodes + 1 + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;    // blocos do mapa de inodes livres
+
+	// se o disco for pequeno demais para os bitmaps, usa o formato antigo
+	if (1 + ninodeblocks + nbitmapblocks + ninodemapblocks >= nblocks) {
+		nbitmapblocks = 0;
+		ninodemapblocks = 0;
+	}
+
+	// blocos do journal, ~3% do disco, mas com espaço para duas transações com a
+	// maior operação: uma transação nunca é dividida (ver journal_start)
+	int op_blocks = journal_op_blocks(nblocks, nbitmapblocks);
+	int njournalblocks = max(min((int)JOURNAL_BLOCKS, nblocks / 32), 2 * (op_blocks + 2) + 1);
+	if (nbitmapblocks && op_blocks > JOURNAL_ENTRIES) {
+		cerr << "ERROR: disk is too large for the journal" << endl;
+		return 0;
+	}
+	// o journal depende dos bitmaps, que são recuperados por ele e não pela varredura
+	if (!nbitmapblocks || 1 + ninodeblocks + nbitmapblocks + ninodemapblocks + njournalblocks >= nblocks) {
+		njournalblocks = 0;
+	}
 
     // prenche o superbloco, com o magic number, n de blocos, n de blocos de inode e n de inodes
 	block.super.magic = FS_MAGIC;
 	block.super.nblocks = nblocks;
 	block.super.ninodeblocks = ninodeblocks;
 	block.super.ninodes = ninodes;
+	block.super.nbitmapblocks = nbitmapblocks;
+	block.super.ninodemapblocks = ninodemapblocks;
+	block.super.clean = 1;
+	block.super.inodeinit = fast ? 1 : 0;
+	block.super.version = (flags & FORMAT_EXTENTS) ? FS_VERSION_EXTENTS
+	                    : (flags & FORMAT_INDIRECT) ? FS_VERSION_INDIRECT : FS_VERSION_POINTERS;
+	block.super.njournalblocks = njournalblocks;
+	block.super.inlinesize = (flags & FORMAT_INLINE) ? INLINE_SIZE : 0;
+
+	cache.write(0, block.data); // escreve o superbloco
+	superblock = block.super;
+	block_types();
+
+    // formata os blocos de inode: um inode todo zerado é inválido, com tamanho 0 e sem ponteiros.
+    // No modo rápido os blocos de dados não precisam ser zerados (um bloco só é lido
+    // depois de escrito), então se o disco não souber abrir buracos nada é escrito
+	if (fast) {
+		cache.discard(1, nblocks - 1);
+	} else {
+		zero_blocks(1, ninodeblocks);
+	}
 
-	disk->write(0, block.data); // escreve o superbloco
-
-    // loop que formata os blocos de inode
-	for (int i = 1; i <= ninodeblocks; i++) {
-		for (int j = 0; j < INODES_PER_BLOCK; j++) {
-			block.inode[j].isvalid = 0;    // ajusta o inode como inválido
-			block.inode[j].size = 0;    // ajusta o tamanho do inode como 0
-			for (int k = 0; k < POINTERS_PER_INODE; k++) {
-				block.inode[j].direct[k] = 0;   // ajusta os ponteiros diretos como 0
-			}
-			block.inode[j].indirect = 0;    // ajusta o ponteiro indireto como 0
+    // escreve os bitmaps iniciais, só com os blocos de metadados e o inode 0 ocupados
+	if (nbitmapblocks) {
+		fblocks_bitmap.resize(nblocks);
+		for (int i = 0; i < data_start(); i++) {
+			fblocks_bitmap.set(i);
 		}
-		disk->write(i, block.data); // escreve os blocos de inode formatados
+		finodes_bitmap.resize(ninodes + 1);
+		finodes_bitmap.set(0);
+
+		bitmap_dirty.assign(nbitmapblocks + ninodemapblocks, 1);
+		bitmap_save();
 	}
 
-    // loop que formata os blocos de dados
-	for (int i = ninodeblocks + 1; i < nblocks; i++) {
-		for (int j = 0; j < Disk::DISK_BLOCK_SIZE; j++) {
-			block.data[j] = 0;  // zera o bloco de dados
-		}
-		disk->write(i, block.data); // escreve o bloco de dados formatado
+    // zera o journal, mesmo no modo rápido, para nenhuma transação de uma formatação
+    // anterior ser reaplicada, e grava o cabeçalho
+	if (njournalblocks) {
+		zero_blocks(journal_first(), njournalblocks);
+		memset(block.data, 0, Disk::DISK_BLOCK_SIZE);
+		block.journal.magic = JOURNAL_MAGIC;
+		block.journal.seq = 1;
+		cache.write_blocks(journal_first(), 1, block.data);
+	}
+
+    // zera os blocos de dados
+	if (!fast) {
+		zero_blocks(data_start(), nblocks - data_start());
 	}
 	return 1;
 }
 
+// função auxiliar que zera count blocos a partir de first, em escritas de FORMAT_CHUNK blocos
+void INE5412_FS::zero_blocks(int first, int count)
+{
+	std::vector<char> zeros((size_t)min(count, (int)FORMAT_CHUNK) * Disk::DISK_BLOCK_SIZE, 0);
+
+	for (int i = 0; i < count; i += FORMAT_CHUNK) {
+		cache.write_blocks(first + i, min(count - i, (int)FORMAT_CHUNK), &zeros[0]);
+	}
+}
+
 void INE5412_FS::fs_debug()
 {
 	union fs_block block;
 
-	disk->read(0, block.data);
+	// grava os buffers de escrita e os inodes alterados na memória antes de ler a tabela
+	if (mounted) {
+		buffer_flush_all();
+		std::lock_guard<std::mutex> guard(table_lock);
+		inode_flush();
+	}
+
+	cache.read(0, block.data);
+	fs_superblock super = block.super;  // o bloco é reaproveitado para ler os inodes
 
     // imprime os dados do superbloco
 	cout << "superblock:\n";
-	cout << "    " << (block.super.magic == FS_MAGIC ? "magic number is valid\n" : "magic number is invalid!\n");
- 	cout << "    " << block.super.nblocks << " blocks\n";
-	cout << "    " << block.super.ninodeblocks << " inode blocks\n";
-	cout << "    " << block.super.ninodes << " inodes\n";
+	cout << "    " << (super.magic == FS_MAGIC ? "magic number is valid\n" : "magic number is invalid!\n");
+ 	cout << "    " << super.nblocks << " blocks\n";
+	cout << "    " << super.ninodeblocks << " inode blocks\n";
+	cout << "    " << super.ninodes << " inodes\n";
+	if (super.inodeinit) {
+		cout << "    " << super.inodeinit - 1 << " inode blocks initialized\n";
+	}
+	if (super.njournalblocks) {
+		cout << "    " << super.njournalblocks << " journal blocks\n";
+	}
+	if (super.version == FS_VERSION_EXTENTS) {
+		cout << "    extent-based inodes\n";
+	} else if (super.version == FS_VERSION_INDIRECT) {
+		cout << "    double and triple indirect inodes\n";
+	}
+	if (super.inlinesize) {
+		cout << "    files up to " << super.inlinesize << " bytes inside the inode\n";
+	}
+	int ndirect = super.version == FS_VERSION_INDIRECT ? INDIRECT_DIRECT : POINTERS_PER_INODE;
+	int nlevels = super.version == FS_VERSION_INDIRECT ? INDIRECT_LEVELS : 1;
 
-    // loop que imprime os dados dos inodes
-    for(int i = 1; i <= block.super.ninodeblocks; i++) {
-        disk->read(i, block.data);  // le o bloco de inode
+    // loop que imprime os dados dos inodes, até o último bloco de inode inicializado
+    for(int i = 1; i <= super.ninodeblocks && (!super.inodeinit || i < super.inodeinit); i++) {
+        meta_read(i, block.data);  // le o bloco de inode
 
         // loop que imprime os dados dos inodes
         for(int j = 0; j < INODES_PER_BLOCK; j++) {
@@ -70,34 +166,57 @@ void INE5412_FS::fs_debug()
             if(block.inode[j].isvalid) {
 				cout << "inode " << (i-1)*INODES_PER_BLOCK+j+1 << ":\n"; // indice do inode
                 cout << "    size: " << block.inode[j].size << " bytes\n";  // tamanho do inode
+
+                // os dados dentro do inode não têm blocos
+                if (block.inode[j].isvalid == INODE_INLINE) {
+                    cout << "    inline data\n";
+                    continue;
+                }
+
+                // no formato de extents, imprime cada extent como (início, n de blocos)
+                if (super.version == FS_VERSION_EXTENTS) {
+                    fs_inode &inode = block.inode[j];
+                    union fs_block ovf_block;   // bloco overflow
+
+                    if (inode.overflow) {
+                        cout << "    overflow block: " << inode.overflow << "\n";
+                        meta_read(inode.overflow, ovf_block.data);
+                    }
+                    cout << "    extents: ";
+                    for (int k = 0; k < min(inode.nextents, INODE_EXTENTS + EXTENTS_PER_BLOCK); k++) {
+                        fs_extent &e = k < INODE_EXTENTS ? inode.extents[k] : ovf_block.extents[k - INODE_EXTENTS];
+                        cout << "(" << e.start << ", " << e.length << ") ";
+                    }
+                    cout << "\n";
+                    continue;
+                }
+
                 cout << "    direct blocks: ";  // blocos diretos
 
                 // loop que imprime os blocos diretos do inode
-                for(int k = 0; k < POINTERS_PER_INODE; k++) {
+                for(int k = 0; k < ndirect; k++) {
                     // se o bloco direto for diferente de 0, imprime o bloco
-                    if(block.inode[j].direct[k]) {
-						cout << block.inode[j].direct[k] << " ";
+                    if(block.inode[j].pointers[k]) {
+						cout << block.inode[j].pointers[k] << " ";
 					}
                 }
                 cout << "\n";
 
-                // se o bloco indireto for diferente de 0, imprime o bloco indireto
-                if(block.inode[j].indirect){
-					cout << "    indirect block: " << block.inode[j].indirect << "\n";
-					cout << "    indirect data blocks: ";
-                    union fs_block ind_block;   // bloco indireto
-
-                    disk->read(block.inode[j].indirect,ind_block.data); // le o bloco indireto
-
-                    // loop que imprime os blocos de dados indiretos
-                    for(int k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        // se bloco de dados indireto for != 0, imprime o bloco
-                        if(ind_block.pointers[k])
-						{
-							cout << ind_block.pointers[k]<< " " ;   // imprime o indice do bloco
-						} 
+                // para cada nível de indireção, imprime o bloco raiz e os blocos de dados que ele alcança
+                for(int level = 1; level <= nlevels; level++) {
+                    int root = block.inode[j].pointers[ndirect + level - 1];
+                    if(root) {
+                        static const char *names[] = { "indirect", "double indirect", "triple indirect" };
+                        std::vector<int> data;
+                        tree_collect(root, level, data, 0);
+
+                        cout << "    " << names[level - 1] << " block: " << root << "\n";
+                        cout << "    " << names[level - 1] << " data blocks: ";
+                        for(std::size_t k = 0; k < data.size(); k++) {
+                            cout << data[k] << " ";
+                        }
+                        cout << "\n";
                     }
-                    cout << "\n";
                 }
             }
         }    
@@ -105,69 +224,372 @@ void INE5412_FS::fs_debug()
 }
 
 // função auxiliar que retorna o bitmap de blocos livres
-void print_bitmap(const std::vector<int>& fblocks_bitmap) {
+void print_bitmap(Bitmap &fblocks_bitmap) {
     cout << "Bitmap: ";
     // loop que imprime o bitmap de blocos livres
-    for (std::size_t i = 0; i < fblocks_bitmap.size(); ++i) {
-        cout << fblocks_bitmap[i] << " ";
+    for (int i = 0; i < fblocks_bitmap.size(); ++i) {
+        cout << fblocks_bitmap.test(i) << " ";
     }
     cout << endl;
 }
 
 int INE5412_FS::fs_mount()
 {
+    Op_Timer timer(op_stats[OP_MOUNT]);
+    // montar de novo jogaria fora a tabela de inodes, os bitmaps, o journal e os
+    // buffers da montagem atual sem gravá-los
+    if (mounted) {
+        cerr << "ERROR: Disk is already mounted" << endl;
+        return 0;
+    }
 
     union fs_block block;
-    disk->read(0, block.data);  // le o superblock
+    disk->set_type(0, 1, Disk::BLOCK_SUPER);
+    cache.read(0, block.data);  // le o superblock
     
-    fs_superblock superblock = block.super;
+    superblock = block.super;
     // verifica se o magic number é válido
     if (superblock.magic != FS_MAGIC) {
         cerr << "ERROR: Invalid magic number!" << endl;
         return 0;
     }
+    if (superblock.version < FS_VERSION_POINTERS || superblock.version > FS_VERSION_INDIRECT) {
+        cerr << "ERROR: Unsupported format version " << superblock.version << endl;
+        return 0;
+    }
+    if (superblock.inlinesize < 0 || superblock.inlinesize > INLINE_SIZE) {
+        cerr << "ERROR: Unsupported inline data size " << superblock.inlinesize << endl;
+        return 0;
+    }
+    block_types();
+
+    fblocks_bitmap.resize(superblock.nblocks);   // limpa o bitmap de blocos livres e ajusta o tamanho para o n de blocos do superbloco
+    finodes_bitmap.resize(superblock.ninodes + 1);  // mapa de inodes livres, indexado pelo inumber, que começa em 1
+    bitmap_dirty.assign(superblock.nbitmapblocks + superblock.ninodemapblocks, 0);
+
+    // a tabela de inodes fica na memória, cada bloco é lido no primeiro acesso
+    inode_table.assign(superblock.ninodeblocks, fs_block());
+    inode_loaded.assign(superblock.ninodeblocks, 0);
+    inode_dirty.assign(superblock.ninodeblocks, 0);
+    inode_changes = 0;
+
+    // descarta os mapas de blocos da montagem anterior
+    map_cache.assign(MAP_CACHE_SIZE, map_entry());
+    map_tick = 0;
+    ra_streams.assign(READAHEAD_STREAMS, ra_stream());
+    ra_tick = 0;
+    write_buffers.clear();
+    write_buffered = 0;
+    reserved_blocks = 0;
+    ra_max = max(cache.size() / 2, (int)READAHEAD_MIN);
+
+    // com journal, reaplica as transações gravadas desde o último checkpoint, e os
+    // bitmaps no disco voltam a valer mesmo depois de uma queda
+    if (journaling()) {
+        journal_op_max = journal_op_blocks(superblock.nblocks, superblock.nbitmapblocks);
+        if (journal_capacity() < journal_op_max) {
+            cerr << "ERROR: journal is too small for the disk" << endl;
+            return 0;
+        }
+        journal_txn.clear();
+        journal_freed.clear();
+        journal_ops = 0;
+        journal_credits = 0;
+        journal_used = 0;
+        journal_replay();
+    }
+
+    // se os bitmaps estão no disco e o disco foi desmontado corretamente, só carrega os bitmaps
+    if (superblock.nbitmapblocks && (superblock.clean || journaling())) {
+        bitmap_load();
+    } else {
+        if (superblock.nbitmapblocks) {
+            cerr << "WARNING: disk was not cleanly unmounted, scanning inodes" << endl;
+        }
+        scan_inodes();
+    }
+
+    inode_cursor = 1;
+    if (print_mount_bitmap) {
+        print_bitmap(fblocks_bitmap);   // imprime o bitmap de blocos livres que foi montado no shell
+    }
+    mounted = true; // seta o disco como montado
+    return 1;
+}
+
+// função auxiliar que monta os bitmaps percorrendo todos os inodes e blocos
+// indiretos. A tabela de inodes é dividida entre até SCAN_THREADS threads, cada
+// uma com bitmaps próprios, que são juntados no fim
+void INE5412_FS::scan_inodes()
+{
+    // bota o bloco 0, a tabela de inodes e a região dos bitmaps como ocupados, mesmo sem inodes validos
+    for (int a = 0; a < data_start(); a++) {
+        fblocks_bitmap.set(a);
+    }
+    finodes_bitmap.set(0);
+
+    int nthreads = min((int)std::thread::hardware_concurrency(), (int)SCAN_THREADS);
+    nthreads = max(1, min(nthreads, superblock.ninodeblocks / SCAN_MIN_BLOCKS));
+
+    if (nthreads == 1) {
+        scan_range(1, superblock.ninodeblocks, fblocks_bitmap, finodes_bitmap);
+    } else {
+        std::vector<Bitmap> blocks(nthreads, Bitmap(superblock.nblocks));
+        std::vector<Bitmap> inodes(nthreads, Bitmap(superblock.ninodes + 1));
+        std::vector<std::thread> workers;
+        int per_thread = (superblock.ninodeblocks + nthreads - 1) / nthreads;
+
+        for (int t = 0; t < nthreads; t++) {
+            int first = 1 + t * per_thread;
+            int last = min(first + per_thread - 1, superblock.ninodeblocks);
+            workers.push_back(std::thread(&INE5412_FS::scan_range, this, first, last, std::ref(blocks[t]), std::ref(inodes[t])));
+        }
+        for (int t = 0; t < nthreads; t++) {
+            workers[t].join();
+            fblocks_bitmap.merge(blocks[t]);
+            finodes_bitmap.merge(inodes[t]);
+        }
+    }
+
+    // os bitmaps no disco estão desatualizados, regrava todos no próximo bitmap_save
+    bitmap_dirty.assign(bitmap_dirty.size(), 1);
+}
 
-    fblocks_bitmap.clear(); // limpa o bitmap de blocos livres
-    fblocks_bitmap.resize(superblock.nblocks, 0);   // ajusta o tamanho do bitmap de blocos livres para o tamanho do n de blocos do superbloco
+// função auxiliar que marca no bitmap os blocos de n extents
+static void mark_extents(const INE5412_FS::fs_extent *ext, int n, Bitmap &blocks)
+{
+    for (int i = 0; i < n; i++) {
+        for (int b = 0; ext[i].start && b < ext[i].length; b++) {
+            blocks.set(ext[i].start + b);
+        }
+    }
+}
 
-    fblocks_bitmap[0] = 1;  // bota o bloco 0 como ocupado
+// função auxiliar que marca nos bitmaps os inodes válidos dos blocos de inode
+// [first, last] e os blocos usados por eles. Os blocos de inode são lidos numa
+// leitura vetorizada direto para a tabela de inodes, e os de mapa em lotes,
+// nível por nível
+void INE5412_FS::scan_range(int first, int last, Bitmap &blocks, Bitmap &inodes)
+{
+    static const int BATCH = 64;   // blocos de mapa lidos por vez
+    std::vector<Disk::block_io> ios;
+
+    // cada thread só mexe nas suas entradas da tabela, sem precisar do table_lock
+    for (int a = first; a <= last; a++) {
+        if (inode_initialized(a)) {
+            Disk::block_io io;
+            io.blocknum = a;
+            io.data = inode_table[a - 1].data;
+            ios.push_back(io);
+        } else {
+            memset(inode_table[a - 1].data, 0, Disk::DISK_BLOCK_SIZE);
+        }
+        inode_loaded[a - 1] = 1;
+    }
+    cache.read_blocks(ios);
 
-    // loop que preenche o bitmap de blocos livres
-    for (int a = 1; a <= superblock.ninodeblocks; a++) {
+    // blocos de mapa (de ponteiros ou overflow) dos inodes válidos, a serem lidos
+    // em lotes. Os blocos de ponteiros de níveis mais altos acrescentam os filhos
+    class map_node {
+        public:
+            int blocknum;
+            int height;     // níveis até os dados (1 = aponta para dados, 0 = overflow)
+            int nextents;   // extents no bloco overflow
+    };
+    std::vector<map_node> pending;
 
-        disk->read(a, block.data);  // le o bloco de inode
+    for (int a = first; a <= last; a++) {
+        fs_block &block = inode_table[a - 1];
 
         // para cada inode no bloco de inode
         for (int b = 0; b < INODES_PER_BLOCK; b++) {
+            fs_inode &inode = block.inode[b];
+
             //  se o inode for válido
-            if (block.inode[b].isvalid) {
-                fblocks_bitmap[a] = 1;  // bota o bloco de inode como ocupado
-
-                // pra cada bloco direto do inode
-                for (int c = 0; c < POINTERS_PER_INODE; c++) {
-                    // se o bloco direto for diferente de 0, bota o bloco direto como ocupado
-                    if (block.inode[b].direct[c]) { 
-                        fblocks_bitmap[int(block.inode[b].direct[c])] = 1;
-                    }
+            if (!inode.isvalid) {
+                continue;
+            }
+            inodes.set((a - 1) * INODES_PER_BLOCK + b + 1);   // bota o inode como ocupado
+            if (inode.isvalid == INODE_INLINE) {
+                continue;   // os dados estão no próprio inode, não há blocos
+            }
+
+            if (extents()) {
+                int n = max(0, min(inode.nextents, INODE_EXTENTS + EXTENTS_PER_BLOCK));
+                mark_extents(inode.extents, min(n, (int)INODE_EXTENTS), blocks);
+                if (inode.overflow) {
+                    blocks.set(inode.overflow);
+                    map_node node = { inode.overflow, 0, max(0, n - INODE_EXTENTS) };
+                    pending.push_back(node);
+                }
+                continue;
+            }
+
+            // pra cada bloco direto do inode, se for diferente de 0, bota como ocupado
+            for (int c = 0; c < tree_direct(); c++) {
+                if (inode.pointers[c]) {
+                    blocks.set(inode.pointers[c]);
+                }
+            }
+            // bota a raiz de cada nível de indireção como ocupada
+            for (int level = 1; level <= tree_levels(); level++) {
+                int root = inode.pointers[tree_direct() + level - 1];
+                if (root) {
+                    blocks.set(root);
+                    map_node node = { root, level, 0 };
+                    pending.push_back(node);
                 }
-                // se o bloco indireto!=0, bota o bloco indireto como ocupado
-                if (block.inode[b].indirect) {
-                    fblocks_bitmap[int(block.inode[b].indirect)] = 1;
+            }
+        }
+    }
 
-                    union fs_block ind_block;
-                    disk->read(block.inode[b].indirect, ind_block.data);    // le o bloco indireto
+    // pra cada bloco apontado pelos blocos de mapa, bota o bloco como ocupado
+    std::vector<fs_block> map_blocks(BATCH);
+    for (std::size_t i = 0; i < pending.size(); ) {
+        std::size_t n = min(pending.size() - i, (std::size_t)BATCH);
+        ios.resize(n);
+        for (std::size_t j = 0; j < n; j++) {
+            ios[j].blocknum = pending[i + j].blocknum;
+            ios[j].data = map_blocks[j].data;
+            disk->set_type(ios[j].blocknum, 1, Disk::BLOCK_INDIRECT);
+        }
+        cache.read_blocks(ios);
 
-                    // pra cada bloco de dados indireto, bota o bloco de dados indireto como ocupado
-                    for (int d = 0; d < POINTERS_PER_BLOCK; d++) {
-                        fblocks_bitmap[int(ind_block.pointers[d])] = 1;
+        for (std::size_t j = 0; j < n; j++) {
+            map_node node = pending[i + j];
+            if (node.height == 0) {
+                mark_extents(map_blocks[j].extents, node.nextents, blocks);
+                continue;
+            }
+            for (int d = 0; d < POINTERS_PER_BLOCK; d++) {
+                int ptr = map_blocks[j].pointers[d];
+                if (ptr) {
+                    blocks.set(ptr);
+                    if (node.height > 1) {
+                        map_node child = { ptr, node.height - 1, 0 };
+                        pending.push_back(child);
                     }
                 }
             }
-        }    
-    }     
-    print_bitmap(fblocks_bitmap);   // imprime o bitmap de blocos livres que foi montado no shell
-    mounted = true; // seta o disco como montado
-    return 1;
+        }
+        i += n;
+    }
+}
+
+// função auxiliar que lê os bitmaps gravados depois da tabela de inodes
+void INE5412_FS::bitmap_load()
+{
+    union fs_block block;
+    int words_per_block = Disk::DISK_BLOCK_SIZE / sizeof(uint64_t);
+    int first = 1 + superblock.ninodeblocks;    // primeiro bloco da região dos bitmaps
+
+    for (int i = 0; i < superblock.nbitmapblocks + superblock.ninodemapblocks; i++) {
+        bool inodemap = i >= superblock.nbitmapblocks;
+        std::vector<uint64_t> &words = inodemap ? finodes_bitmap.raw() : fblocks_bitmap.raw();
+        int w = (inodemap ? i - superblock.nbitmapblocks : i) * words_per_block;
+
+        cache.read(first + i, block.data);
+        memcpy(&words[w], block.data, min((int)words.size() - w, words_per_block) * sizeof(uint64_t));
+    }
+
+    fblocks_bitmap.recount();
+    finodes_bitmap.recount();
+}
+
+// função auxiliar que grava os blocos alterados dos bitmaps
+void INE5412_FS::bitmap_save()
+{
+    std::lock_guard<std::mutex> guard(alloc_lock);
+    union fs_block block;
+    int words_per_block = Disk::DISK_BLOCK_SIZE / sizeof(uint64_t);
+    int first = 1 + superblock.ninodeblocks;
+
+    for (std::size_t i = 0; i < bitmap_dirty.size(); i++) {
+        if (!bitmap_dirty[i]) {
+            continue;
+        }
+        bool inodemap = (int)i >= superblock.nbitmapblocks;
+        std::vector<uint64_t> &words = inodemap ? finodes_bitmap.raw() : fblocks_bitmap.raw();
+        int w = (inodemap ? i - superblock.nbitmapblocks : i) * words_per_block;
+
+        memset(block.data, 0, Disk::DISK_BLOCK_SIZE);
+        memcpy(block.data, &words[w], min((int)words.size() - w, words_per_block) * sizeof(uint64_t));
+        meta_write(first + i, block.data);
+        bitmap_dirty[i] = 0;
+    }
+}
+
+// função auxiliar que marca um bloco como ocupado/livre e o bloco do bitmap como
+// alterado. Chamada com o alloc_lock
+void INE5412_FS::block_mark(int blocknum, bool used)
+{
+    if (used) {
+        fblocks_bitmap.set(blocknum);
+    } else {
+        fblocks_bitmap.clear(blocknum);
+        disk->set_type(blocknum, 1, Disk::BLOCK_DATA);
+    }
+    if (superblock.nbitmapblocks) {
+        if (!journaling()) {
+            set_clean(false);   // com journal, a queda é recuperada pelo replay
+        }
+        if (!bitmap_dirty[blocknum / BITS_PER_BLOCK]) {
+            journal_count(1 + superblock.ninodeblocks + blocknum / BITS_PER_BLOCK);
+        }
+        bitmap_dirty[blocknum / BITS_PER_BLOCK] = 1;
+    }
+}
+
+// função auxiliar que marca um inode como ocupado/livre e o bloco do mapa como
+// alterado. Chamada com o alloc_lock
+void INE5412_FS::inode_mark(int inumber, bool used)
+{
+    if (used) {
+        finodes_bitmap.set(inumber);
+    } else {
+        finodes_bitmap.clear(inumber);
+    }
+    if (superblock.nbitmapblocks) {
+        if (!journaling()) {
+            set_clean(false);   // com journal, a queda é recuperada pelo replay
+        }
+        if (!bitmap_dirty[superblock.nbitmapblocks + inumber / BITS_PER_BLOCK]) {
+            journal_count(1 + superblock.ninodeblocks + superblock.nbitmapblocks + inumber / BITS_PER_BLOCK);
+        }
+        bitmap_dirty[superblock.nbitmapblocks + inumber / BITS_PER_BLOCK] = 1;
+    }
+}
+
+// função auxiliar que grava a flag de desmontagem limpa no superbloco. Sem journal, a
+// flag é limpa antes da primeira alteração, assim uma queda força a varredura no mount
+void INE5412_FS::set_clean(bool clean)
+{
+    if (!superblock.nbitmapblocks || superblock.clean == (int)clean) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(super_lock);
+    union fs_block block;
+    cache.read(0, block.data);
+    block.super.clean = clean;
+    cache.write(0, block.data);
+    cache.sync(0);  // a flag precisa chegar no disco antes das outras alterações
+    superblock.clean = clean;
+}
+
+// escreve os blocos pendentes do cache no disco e desmonta
+void INE5412_FS::fs_unmount()
+{
+    if (mounted) {
+        fs_sync();      // dados e metadados antes da flag
+        if (journaling()) {
+            std::lock_guard<std::mutex> guard(journal_lock);
+            journal_checkpoint();   // o próximo mount não tem nada a reaplicar
+        }
+        set_clean(true);
+    }
+    cache.close();
+    mounted = false;
 }
 
 // função auxiliar que carrega o inode
@@ -183,9 +605,8 @@ void INE5412_FS::inode_load( int inumber, class fs_inode *inode )
     int block_number = 1 + (inumber - 1) / INODES_PER_BLOCK;    // calcula o número do bloco de inode
     int inode_index = (inumber - 1) % INODES_PER_BLOCK; // calcula o índice do inode no bloco de inode
     
-    union fs_block block;
-    disk->read(block_number, block.data);   // le o bloco de inode usando o block_number calculado
-    *inode = block.inode[inode_index];  // carrega o inode
+    std::lock_guard<std::mutex> guard(table_lock);
+    *inode = inode_block(block_number)->inode[inode_index];  // carrega o inode da tabela em memória
 }
 
 // função auxiliar que salva o inode
@@ -201,214 +622,2387 @@ void INE5412_FS::inode_save( int inumber, class fs_inode *inode )
     int block_number = 1 + (inumber - 1) / INODES_PER_BLOCK; // calcula o número do bloco de inode
     int inode_index = (inumber - 1) % INODES_PER_BLOCK; // calcula o índice do inode no bloco de inode
 
-    union fs_block block;
-    disk->read(block_number, block.data);   // le o bloco de inode usando o block_number calculado
-    block.inode[inode_index] = *inode;  // salva o inode no bloco de inode
-
-    disk->write(block_number, block.data);  // escreve o bloco de inode
+    std::lock_guard<std::mutex> guard(table_lock);
+    inode_block(block_number)->inode[inode_index] = *inode;  // salva o inode na tabela em memória
+    inode_touch(block_number);
 }
 
-int INE5412_FS::fs_create()
+// função auxiliar que retorna o bloco de inode residente na memória, lendo do
+// disco no primeiro acesso. Esta e as próximas funções da tabela são chamadas com o table_lock
+INE5412_FS::fs_block *INE5412_FS::inode_block(int block_number)
 {
-    //checa se está montado
-    if (!mounted) {
-        cerr << "ERROR: Disk is not mounted" << endl;
-        return 0;
+    if (!inode_loaded[block_number - 1]) {
+        // um bloco ainda não inicializado tem só inodes livres, não precisa ser lido
+        if (inode_initialized(block_number)) {
+            cache.read(block_number, inode_table[block_number - 1].data);
+        } else {
+            memset(inode_table[block_number - 1].data, 0, Disk::DISK_BLOCK_SIZE);
+        }
+        inode_loaded[block_number - 1] = 1;
     }
+    return &inode_table[block_number - 1];
+}
 
-    union fs_block block;
-    disk->read(0, block.data);  // le o superbloco
-
-    fs_inode inode;
-
-    int inumber;
+// função auxiliar que marca o bloco de inode como alterado e grava a tabela
+// depois de inode_flush_interval alterações
+void INE5412_FS::inode_touch(int block_number)
+{
+    if (!inode_dirty[block_number - 1]) {
+        journal_count(block_number);
+    }
+    inode_dirty[block_number - 1] = 1;
+    inode_changes++;
 
-    // loop que procura um inode livre
-    for (inumber = 1; inumber <= block.super.ninodes; inumber++) {
-        inode_load(inumber, &inode);  // carrega o inode
-        
-        // se o inode for inválido, cria o inode
-        if (!inode.isvalid) {
-            inode.isvalid = 1;  // seta o inode como válido
-            inode.size = 0; // seta o tamanho do inode como 0
+    if (inode_flush_interval && inode_changes >= inode_flush_interval) {
+        inode_flush();
+    }
+}
 
-            //  seta os ponteiros diretos do inode como 0
-            for (int i = 0; i < POINTERS_PER_INODE; i++) {
-                inode.direct[i] = 0;
+// função auxiliar que grava todos os blocos de inode alterados de uma vez
+void INE5412_FS::inode_flush()
+{
+    // blocos depois da marca de inicialização são gravados antes, junto com os anteriores a eles
+    if (superblock.inodeinit) {
+        for (int i = inode_dirty.size() - 1; i >= superblock.inodeinit - 1; i--) {
+            if (inode_dirty[i]) {
+                inode_init(i + 1);
+                break;
             }
-            inode.indirect = 0; // seta o ponteiro indireto como 0
+        }
+    }
 
-            inode_save(inumber, &inode);    // salva o inod criado
-            fs_mount(); // remonta o disco 
-            return inumber; // retorna o inumber do inode criado
+    for (std::size_t i = 0; i < inode_dirty.size(); i++) {
+        if (inode_dirty[i]) {
+            meta_write(i + 1, inode_table[i].data);
+            inode_dirty[i] = 0;
         }
+    }
+    inode_changes = 0;
+}
 
+// função auxiliar que inicializa a tabela de inodes até o bloco last: grava no
+// disco zeros nos blocos entre a marca de inicialização e last e só depois avança
+// a marca no superbloco, assim um bloco antes da marca nunca tem lixo, mesmo que
+// os buracos do fs_format rápido não tenham sido abertos. Os inodes alterados
+// continuam marcados e são gravados depois, pelo caminho normal (pelo journal, se houver)
+void INE5412_FS::inode_init(int last)
+{
+    union fs_block zero;
+    memset(zero.data, 0, Disk::DISK_BLOCK_SIZE);
+    for (int b = superblock.inodeinit; b <= last; b++) {
+        cache.write(b, zero.data);
+        cache.sync(b);
     }
 
-    //  se não achar um inode livre dentro do n de inodes, retorna erro
-    cerr << "ERROR: inode table is full" << endl;
-	return 0;
+    std::lock_guard<std::mutex> guard(super_lock);
+    union fs_block block;
+    cache.read(0, block.data);
+    block.super.inodeinit = last < superblock.ninodeblocks ? last + 1 : 0;
+    cache.write(0, block.data);
+    cache.sync(0);
+    superblock.inodeinit = block.super.inodeinit;
 }
 
-int INE5412_FS::fs_delete(int inumber)
+// grava os buffers de escrita, a tabela de inodes, os bitmaps e os blocos pendentes do cache. Com
+// journal, os metadados vão numa transação, que leva junto os dados pendentes
+void INE5412_FS::fs_sync()
+{
+    Op_Timer timer(op_stats[OP_SYNC]);
+    if (mounted) {
+        buffer_flush_all();
+    }
+    if (mounted && journaling()) {
+        journal_commit();
+        return;
+    }
+    if (mounted) {
+        {
+            std::lock_guard<std::mutex> guard(table_lock);
+            inode_flush();
+        }
+        bitmap_save();
+    }
+    cache.flush();
+    disk->sync();
+}
+
+// confere a consistência do disco montado: cada bloco de dados ou de mapa
+// pertence a um arquivo só e fica na região de dados, o bitmap de blocos
+// livres marca exatamente os blocos usados, o mapa de inodes livres marca
+// exatamente os inodes válidos, e nenhum inode tem blocos depois do tamanho.
+// Grava antes tudo o que estiver pendente, como o fs_sync. Como o mount, deve
+// ser chamada sem nenhuma outra operação em andamento. Retorna 1 se estiver
+// tudo certo, senão imprime os problemas encontrados e retorna 0
+int INE5412_FS::fs_check()
 {
-    // verifica se está montado
     if (!mounted) {
         cerr << "ERROR: Disk is not mounted" << endl;
         return 0;
     }
+    fs_sync();
 
-    fs_inode inode;
-    inode_load(inumber, &inode); // carrega o inode pelo inumber
+    Bitmap used(superblock.nblocks);
+    std::vector<int> owner(superblock.nblocks, 0);  // inode dono de cada bloco (0 = nenhum)
+    int errors = 0;
 
-    // se o inumber for inválido, retorna erro
-    if (!inode.isvalid) {
-        cerr << "ERROR: Invalid inumber" << endl;
-        return 0;
+    for (int b = 0; b < data_start(); b++) {
+        used.set(b);
     }
 
-    inode.isvalid = 0;  // bora o inode como inválido
-    inode.size = 0; // bota o tamanho do inode como 0
+    for (int inumber = 1; inumber <= superblock.ninodes; inumber++) {
+        fs_inode inode;
+        inode_load(inumber, &inode);
 
-    // bota os ponteiros diretos do inode como 0
-    for (int i = 0; i < POINTERS_PER_INODE; i++) {
-        if (inode.direct[i]) {
-            inode.direct[i] = 0;
-            //fblocks_bitmap[inode.direct[i]] = 0;
+        if (!inode.isvalid) {
+            if (finodes_bitmap.test(inumber)) {
+                cerr << "ERROR: free inode " << inumber << " is marked as used" << endl;
+                errors++;
+            }
+            continue;
+        }
+        if (!finodes_bitmap.test(inumber)) {
+            cerr << "ERROR: inode " << inumber << " is valid but marked as free" << endl;
+            errors++;
         }
-    }
-    
-    inode.indirect = 0; // bota o ponteiro indireto como 0
 
-    inode_save(inumber, &inode);    // salva o inode
+        std::vector<int> blocks;
+        file_blocks(inode, blocks);
+        for (std::size_t i = 0; i < blocks.size(); i++) {
+            int b = blocks[i];
+            if (b < data_start() || b >= superblock.nblocks) {
+                cerr << "ERROR: inode " << inumber << " uses block " << b << " outside the data region" << endl;
+                errors++;
+            } else if (owner[b]) {
+                cerr << "ERROR: block " << b << " is used by inodes " << owner[b] << " and " << inumber << endl;
+                errors++;
+            } else {
+                owner[b] = inumber;
+                used.set(b);
+            }
+        }
 
-    fs_mount(); // remonta o disco
-	return 1;
+        // os blocos de dados depois do tamanho do arquivo não deveriam existir
+        if (inode.isvalid != INODE_INLINE && !extents()) {
+            int nblocks = (inode.size + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE;
+            int max_blocks = tree_max_blocks();
+            std::vector<int> tail;
+            if (nblocks < max_blocks) {
+                resolve_blocks(inode, nblocks, min(max_blocks - nblocks, (int)POINTERS_PER_BLOCK), tail);
+            }
+            for (std::size_t i = 0; i < tail.size(); i++) {
+                if (tail[i]) {
+                    cerr << "ERROR: inode " << inumber << " has block " << tail[i] << " past its size" << endl;
+                    errors++;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int b = 0; b < superblock.nblocks; b++) {
+        if (used.test(b) != fblocks_bitmap.test(b)) {
+            cerr << "ERROR: block " << b << " is " << (used.test(b) ? "used" : "free")
+                 << " but marked as " << (used.test(b) ? "free" : "used") << endl;
+            errors++;
+        }
+    }
+    return errors == 0;
 }
 
-int INE5412_FS::fs_getsize(int inumber)
+// imprime os contadores de cada operação (chamadas, bytes, latência média,
+// percentis e máxima), as leituras e escritas do Disk por tipo de bloco e os
+// acertos dos caches, como texto ou como JSON. Os percentis são o limite
+// superior do bucket do histograma, em potências de 2 de microssegundos
+void INE5412_FS::fs_stats(ostream &out, bool json)
 {
-    // verifica se está montado
-    if (!mounted) {
-        cerr << "ERROR: Disk is not mounted" << endl;
-        return 0;
+    static const char *names[OPS] = { "mount", "create", "delete", "getsize", "read", "write", "punch", "sync" };
+    long cache_total = cache.hits() + cache.misses();
+    long map_total = map_hits + map_misses;
+    double cache_ratio = cache_total ? (double)cache.hits() / cache_total : 0;
+    double map_ratio = map_total ? (double)map_hits / map_total : 0;
+
+    if (!json) {
+        out << "operations:\n";
+        for (int op = 0; op < OPS; op++) {
+            Op_Stats &st = op_stats[op];
+            out << "    " << names[op] << ": " << st.calls() << " calls";
+            if (st.bytes()) {
+                out << ", " << st.bytes() << " bytes";
+            }
+            if (st.calls()) {
+                out << ", mean " << st.total_ns() / st.calls() / 1000 << " us"
+                    << ", p50 < " << st.percentile(50) << " us"
+                    << ", p99 < " << st.percentile(99) << " us"
+                    << ", max " << st.max_ns() / 1000 << " us";
+            }
+            out << "\n";
+        }
+        out << "disk: " << disk->reads() << " block reads, " << disk->writes() << " block writes\n";
+        for (int t = 0; t < Disk::BLOCK_TYPES; t++) {
+            out << "    " << Disk::type_name(t) << ": " << disk->reads(t) << " reads, " << disk->writes(t) << " writes\n";
+        }
+        out << "block cache: " << cache.hits() << " hits, " << cache.misses() << " misses ("
+            << (int)(cache_ratio * 100) << "% hits), " << cache.readaheads() << " blocks read ahead\n";
+        out << "map cache: " << map_hits << " hits, " << map_misses << " misses ("
+            << (int)(map_ratio * 100) << "% hits)\n";
+        return;
     }
 
-    fs_inode inode;
-    inode_load(inumber, &inode);    //carrega o inode pelo inumber
-
-    // se inode for válido, retorna o tamanho do inode
-    if (inode.isvalid) {
-        return inode.size;
+    out << "{\n  \"operations\": {\n";
+    for (int op = 0; op < OPS; op++) {
+        Op_Stats &st = op_stats[op];
+        out << "    \"" << names[op] << "\": {\"calls\": " << st.calls()
+            << ", \"bytes\": " << st.bytes()
+            << ", \"total_ns\": " << st.total_ns()
+            << ", \"max_ns\": " << st.max_ns()
+            << ", \"p50_us\": " << st.percentile(50)
+            << ", \"p99_us\": " << st.percentile(99)
+            << ", \"histogram_log2_us\": [";
+        for (int b = 0; b < Op_Stats::BUCKETS; b++) {
+            out << (b ? ", " : "") << st.bucket(b);
+        }
+        out << "]}" << (op + 1 < OPS ? "," : "") << "\n";
     }
-
-    //se o inumber for inválido, retorna erro
-    cerr << "ERROR: Invalid inumber" << endl;
-	return -1;
+    out << "  },\n  \"disk\": {\"reads\": " << disk->reads() << ", \"writes\": " << disk->writes();
+    for (int t = 0; t < Disk::BLOCK_TYPES; t++) {
+        out << ", \"" << Disk::type_name(t) << "\": {\"reads\": " << disk->reads(t)
+            << ", \"writes\": " << disk->writes(t) << "}";
+    }
+    out << "},\n";
+    out << "  \"block_cache\": {\"hits\": " << cache.hits() << ", \"misses\": " << cache.misses()
+        << ", \"hit_ratio\": " << cache_ratio << ", \"readahead\": " << cache.readaheads() << "},\n";
+    out << "  \"map_cache\": {\"hits\": " << map_hits << ", \"misses\": " << map_misses
+        << ", \"hit_ratio\": " << map_ratio << "}\n}\n";
 }
 
-int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
+// zera os contadores do fs_stats
+void INE5412_FS::fs_stats_reset()
 {
-    // verifica se está montado
-    if (!mounted) {
-        cerr << "ERROR: Disk is not mounted" << endl;
-        return 0;
+    for (int op = 0; op < OPS; op++) {
+        op_stats[op].reset();
     }
+    disk->reset_counters();
+    cache.reset_counters();
+    map_hits = 0;
+    map_misses = 0;
+}
 
-    fs_inode inode;
+// função auxiliar que marca no Disk o tipo dos blocos de cada região, para os
+// contadores de E/S. Os blocos de ponteiros e overflow, que ficam entre os de
+// dados, são marcados ao passar pelo meta_read/meta_write ou pela varredura
+void INE5412_FS::block_types()
+{
+    int bitmaps = superblock.nbitmapblocks + superblock.ninodemapblocks;
 
-    // carrega o inode correspondente ao inumber
-    inode_load(inumber, &inode);
+    disk->set_type(0, 1, Disk::BLOCK_SUPER);
+    disk->set_type(1, superblock.ninodeblocks, Disk::BLOCK_INODE);
+    disk->set_type(1 + superblock.ninodeblocks, bitmaps, Disk::BLOCK_BITMAP);
+    disk->set_type(journal_first(), superblock.njournalblocks, Disk::BLOCK_JOURNAL);
+    disk->set_type(data_start(), superblock.nblocks - data_start(), Disk::BLOCK_DATA);
+}
 
-    // se o inumber for inválido, retorna erro
-    if(!inode.isvalid) {
-        cerr << "ERROR: Invalid inumber" << endl;
-        return 0;
+// função auxiliar que lê um bloco de metadados: se ele estiver na transação em
+// andamento, a imagem de lá, que é mais nova que a do disco
+void INE5412_FS::meta_read(int blocknum, char *data)
+{
+    if (blocknum >= data_start()) {
+        disk->set_type(blocknum, 1, Disk::BLOCK_INDIRECT);
     }
-
-    int inode_size = fs_getsize(inumber);
-
-    // se o offset for maior ao tamanho do inode, retorna erro
-    if (offset > inode_size) {
-        cerr << "ERROR: offset is greater than inode size" << endl;
-        return 0;
+    if (mounted && journaling()) {
+        std::lock_guard<std::mutex> guard(journal_lock);
+        std::map<int, fs_block>::iterator it = journal_txn.find(blocknum);
+        if (it != journal_txn.end()) {
+            memcpy(data, it->second.data, Disk::DISK_BLOCK_SIZE);
+            return;
+        }
     }
+    cache.read(blocknum, data);
+}
 
-    // se o tamanho do inode for 0, retorna erro
-    if (inode_size == 0) {
-        cerr << "ERROR: inode size is 0" << endl;
-        return 0;
+// função auxiliar que grava um bloco de metadados (de inode, dos bitmaps, de
+// ponteiros ou overflow). Com journal, a imagem fica na transação em andamento
+// e só vai para o cache depois de gravada no journal, pelo journal_commit. O
+// fs_format, com o disco desmontado, grava direto
+void INE5412_FS::meta_write(int blocknum, const char *data)
+{
+    if (blocknum >= data_start()) {
+        disk->set_type(blocknum, 1, Disk::BLOCK_INDIRECT);
     }
+    if (!mounted || !journaling()) {
+        cache.write(blocknum, data);
+        return;
+    }
+    // os blocos de inode e dos bitmaps são contados quando são alterados (ver journal_count)
+    std::lock_guard<std::mutex> guard(journal_lock);
+    if (blocknum >= data_start() && !journal_txn.count(blocknum)) {
+        journal_used++;
+    }
+    memcpy(journal_txn[blocknum].data, data, Disk::DISK_BLOCK_SIZE);
+}
 
+// blocos que uma única operação pode pôr numa transação, no pior caso: os de
+// ponteiros (ou o overflow) do arquivo, todos os do bitmap de blocos (uma
+// escrita ou um fs_delete pode alocar ou liberar blocos em qualquer lugar do
+// disco), dois de inode e dois do mapa de inodes (ver create_batch)
+int INE5412_FS::journal_op_blocks(int nblocks, int nbitmapblocks)
+{
+    int data = min(nblocks, INT_MAX / Disk::DISK_BLOCK_SIZE);
+    return data / (POINTERS_PER_BLOCK - 1) + INDIRECT_LEVELS + 1 + nbitmapblocks + 2 + 2;
+}
 
-    int length_to_read = min(length, inode_size - offset);  // calcula o tamanho de bytes a serem lidos
+// maior transação: o journal tem espaço para duas, cada uma com descritor e commit
+int INE5412_FS::journal_capacity()
+{
+    return min((superblock.njournalblocks - 1) / 2 - 2, (int)JOURNAL_ENTRIES);
+}
 
-    int bytes_read = 0; // contador de bytes lidos
+// função auxiliar que conta em journal_used um bloco de inode ou dos bitmaps que
+// acabou de ser alterado, se ele ainda não estiver na transação em andamento.
+// Chamada com o table_lock ou o alloc_lock
+void INE5412_FS::journal_count(int blocknum)
+{
+    if (!mounted || !journaling()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(journal_lock);
+    if (!journal_txn.count(blocknum)) {
+        journal_used++;
+    }
+}
 
-    // loop para ler os dados
-    while (bytes_read < length_to_read) {
+// blocos que a transação em andamento pode ter no próximo commit, contando os
+// blocos do bitmap que os blocos liberados vão alterar. Chamada com o journal_lock
+int INE5412_FS::journal_pending()
+{
+    return journal_used + min((int)journal_freed.size(), superblock.nbitmapblocks);
+}
+
+// função auxiliar chamada no início de cada operação que altera metadados (ver
+// journal_handle). Reserva na transação em andamento espaço para o pior caso da
+// operação; se não houver, grava a transação antes. Assim uma transação sempre
+// cabe no journal e nunca precisa ser dividida
+void INE5412_FS::journal_start()
+{
+    for (;;) {
+        commit_lock.lock_shared();
+        {
+            std::lock_guard<std::mutex> guard(journal_lock);
+            if (journal_pending() + journal_credits + journal_op_max <= journal_capacity()) {
+                journal_credits += journal_op_max;
+                return;
+            }
+        }
+        commit_lock.unlock_shared();
+        journal_commit();
+    }
+}
+
+// função auxiliar chamada no fim de cada operação que altera metadados. As
+// operações são juntadas numa transação, gravada a cada inode_flush_interval
+// operações ou antes, se a próxima operação puder não caber nela
+void INE5412_FS::journal_stop()
+{
+    bool due;
+    {
+        std::lock_guard<std::mutex> guard(journal_lock);
+        journal_credits -= journal_op_max;
+        journal_ops++;
+        due = (inode_flush_interval && journal_ops >= inode_flush_interval)
+           || journal_pending() + journal_op_max > journal_capacity();
+    }
+    if (due) {
+        journal_commit();
+    }
+}
+
+// soma de verificação de n blocos do journal (FNV-1a sobre palavras de 32 bits)
+static unsigned int journal_checksum(const INE5412_FS::fs_block *blocks, int n)
+{
+    unsigned int sum = 2166136261u;
+    for (int i = 0; i < n; i++) {
+        const unsigned int *words = (const unsigned int *)blocks[i].data;
+        for (int w = 0; w < Disk::DISK_BLOCK_SIZE / (int)sizeof(unsigned int); w++) {
+            sum = (sum ^ words[w]) * 16777619u;
+        }
+    }
+    return sum;
+}
+
+// grava a transação em andamento no journal. Espera as operações em andamento
+// terminarem, junta na transação os inodes e bitmaps alterados, e grava a
+// transação inteira, junto com os dados pendentes no cache. Só então as imagens
+// vão para o cache, de onde chegam ao lugar delas aos poucos
+void INE5412_FS::journal_commit()
+{
+    std::unique_lock<std::shared_mutex> commit_guard(commit_lock);
+
+    // os blocos liberados pelo fs_delete e pelo fs_punch voltam ao bitmap agora: nenhuma operação
+    // pode realocá-los antes da transação que os libera estar no disco
+    std::vector<int> freed;
+    {
+        std::lock_guard<std::mutex> guard(journal_lock);
+        freed.swap(journal_freed);
+    }
+    if (!freed.empty()) {
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        for (std::size_t i = 0; i < freed.size(); i++) {
+            block_mark(freed[i], false);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(table_lock);
+        inode_flush();
+    }
+    bitmap_save();
+
+    std::lock_guard<std::mutex> guard(journal_lock);
+    journal_ops = 0;
+    journal_used = 0;
+
+    // blocos liberados não vão para o journal. Os que foram numa transação anterior
+    // são revogados, para o replay não sobrescrever o bloco já reaproveitado
+    std::vector<int> revoked;
+    for (std::size_t i = 0; i < freed.size(); i++) {
+        journal_txn.erase(freed[i]);
+        if (journal_logged.erase(freed[i])) {
+            revoked.push_back(freed[i]);
+        }
+    }
+
+    std::vector<int> blocks;
+    for (std::map<int, fs_block>::iterator it = journal_txn.begin(); it != journal_txn.end(); ++it) {
+        blocks.push_back(it->first);
+    }
+
+    // a transação cabe no journal vazio (ver journal_start). Se não couber no que
+    // resta dele, ou se os revogados não couberem no descritor, o journal é
+    // esvaziado antes, e então não há o que revogar
+    if ((int)(blocks.size() + revoked.size()) > JOURNAL_ENTRIES
+        || journal_head + (int)blocks.size() + 2 > superblock.njournalblocks) {
+        journal_checkpoint();
+        revoked.clear();
+    }
+
+    if (!blocks.empty() || !revoked.empty()) {
+        journal_write(blocks.data(), blocks.size(), revoked);
+    } else {
+        // sem metadados alterados, só os dados pendentes vão para o disco
+        cache.flush();
+        disk->sync();
+    }
+
+    if (discard_freed) {
+        discard_blocks(freed);
+    }
+}
+
+// função auxiliar que grava no journal uma transação com as imagens dos count
+// blocos da transação em andamento e os blocos revogados, e depois passa as
+// imagens para o cache. O bloco de commit só é gravado depois que os dados
+// pendentes, o descritor e as imagens estão no disco, e a transação só vale
+// (para o replay) com ele. Chamada com o journal_lock
+void INE5412_FS::journal_write(const int *blocks, int count, std::vector<int> &revoked)
+{
+    std::vector<fs_block> log(count + 1);
+    fs_journal &desc = log[0].journal;
+
+    memset(log[0].data, 0, Disk::DISK_BLOCK_SIZE);
+    desc.magic = JOURNAL_MAGIC;
+    desc.seq = journal_seq;
+    desc.count = count;
+    desc.nrevoke = revoked.size();
+    std::copy(blocks, blocks + count, desc.blocks);
+    std::copy(revoked.begin(), revoked.end(), desc.blocks + count);
+    for (int i = 0; i < count; i++) {
+        log[i + 1] = journal_txn[blocks[i]];
+    }
+    desc.checksum = journal_checksum(&log[0], count + 1);
+
+    cache.flush();
+    cache.write_blocks(journal_first() + journal_head, count + 1, log[0].data);
+    disk->sync();
+
+    union fs_block commit;
+    memset(commit.data, 0, Disk::DISK_BLOCK_SIZE);
+    commit.journal.magic = JOURNAL_COMMIT_MAGIC;
+    commit.journal.seq = journal_seq;
+    commit.journal.checksum = desc.checksum;
+    cache.write_blocks(journal_first() + journal_head + count + 1, 1, commit.data);
+    disk->sync();
+    journal_head += count + 2;
+    journal_seq++;
+
+    for (int i = 0; i < count; i++) {
+        cache.write(blocks[i], log[i + 1].data);
+        if (blocks[i] >= data_start()) {
+            journal_logged.insert(blocks[i]);
+        }
+        journal_txn.erase(blocks[i]);
+    }
+}
+
+// função auxiliar que grava no lugar os blocos das transações do journal e o
+// esvazia: o cabeçalho passa a ter a seq da próxima transação, e as que estão
+// no journal deixam de ser reaplicadas. Chamada com o journal_lock
+void INE5412_FS::journal_checkpoint()
+{
+    cache.flush();
+    disk->sync();
+
+    union fs_block header;
+    memset(header.data, 0, Disk::DISK_BLOCK_SIZE);
+    header.journal.magic = JOURNAL_MAGIC;
+    header.journal.seq = journal_seq;
+    cache.write_blocks(journal_first(), 1, header.data);
+    disk->sync();
+
+    journal_head = 1;
+    journal_logged.clear();
+}
+
+// função auxiliar do fs_mount que reaplica as transações gravadas no journal
+// desde o último checkpoint. Só o journal é lido: a primeira transação inválida
+// (pela metade, sem o bloco de commit, com a soma errada ou de uma volta
+// anterior) marca o fim
+void INE5412_FS::journal_replay()
+{
+    int n = superblock.njournalblocks;
+    std::vector<fs_block> log(n);
+    std::vector<Disk::block_io> ios(n);
+    for (int i = 0; i < n; i++) {
+        ios[i].blocknum = journal_first() + i;
+        ios[i].data = log[i].data;
+    }
+    cache.read_blocks(ios);
+
+    bool header_ok = log[0].journal.magic == JOURNAL_MAGIC;
+    journal_seq = header_ok ? log[0].journal.seq : 1;
+
+    // primeira passada: acha as transações válidas e a última revogação de cada bloco
+    std::vector<int> valid;     // posição dos descritores
+    std::unordered_map<int, int> revoked;   // bloco -> seq da última revogação
+    int pos = 1;
+    while (pos < n) {
+        fs_journal &desc = log[pos].journal;
+        if (desc.magic != JOURNAL_MAGIC || desc.seq != journal_seq || desc.count < 0 || desc.nrevoke < 0
+            || desc.count + desc.nrevoke > JOURNAL_ENTRIES || pos + 2 + desc.count > n) {
+            break;
+        }
+        fs_journal &commit = log[pos + 1 + desc.count].journal;
+        unsigned int checksum = desc.checksum;
+        desc.checksum = 0;
+        if (commit.magic != JOURNAL_COMMIT_MAGIC || commit.seq != desc.seq || commit.checksum != checksum
+            || journal_checksum(&log[pos], desc.count + 1) != checksum) {
+            break;
+        }
+        for (int i = 0; i < desc.nrevoke; i++) {
+            revoked[desc.blocks[desc.count + i]] = desc.seq;
+        }
+        valid.push_back(pos);
+        pos += 2 + desc.count;
+        journal_seq++;
+    }
+
+    // segunda passada: grava as imagens no lugar, menos as de blocos revogados
+    // na mesma transação ou numa posterior
+    for (std::size_t t = 0; t < valid.size(); t++) {
+        fs_journal &desc = log[valid[t]].journal;
+        for (int i = 0; i < desc.count; i++) {
+            int b = desc.blocks[i];
+            if (b < 1 || b >= superblock.nblocks || (b >= journal_first() && b < data_start())) {
+                continue;
+            }
+            std::unordered_map<int, int>::iterator it = revoked.find(b);
+            if (it != revoked.end() && it->second >= desc.seq) {
+                continue;
+            }
+            cache.write(b, log[valid[t] + 1 + i].data);
+        }
+    }
+
+    journal_head = 1;
+    journal_logged.clear();
+    if (!valid.empty() || !header_ok) {
+        if (!valid.empty()) {
+            cerr << "WARNING: replaying " << valid.size() << " journal transactions" << endl;
+        }
+        journal_checkpoint();
+    }
+}
+
+int INE5412_FS::fs_create()
+{
+    Op_Timer timer(op_stats[OP_CREATE]);
+    //checa se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    journal_handle handle(this);
+
+    // pega o primeiro inode livre a partir do cursor, sem ler a tabela de inodes,
+    // e já marca como ocupado para nenhuma outra thread pegar o mesmo
+    int inumber;
+    {
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        inumber = finodes_bitmap.find_free_near(inode_cursor);
+
+        //  se não achar um inode livre dentro do n de inodes, retorna erro
+        if (inumber < 0) {
+            cerr << "ERROR: inode table is full" << endl;
+            return 0;
+        }
+        inode_mark(inumber, true);    // marca o inode como ocupado
+        inode_cursor = inumber + 1;
+    }
+
+    fs_inode inode;
+    inode.isvalid = 1;  // seta o inode como válido
+    inode.size = 0; // seta o tamanho do inode como 0
+
+    //  seta os ponteiros diretos do inode como 0
+    for (int i = 0; i < POINTERS_PER_INODE; i++) {
+        inode.direct[i] = 0;
+    }
+    inode.indirect = 0; // seta o ponteiro indireto como 0
+
+    inode_save(inumber, &inode);    // salva o inode criado
+    bitmap_save();
+    return inumber; // retorna o inumber do inode criado
+}
+
+// cria n inodes de uma vez, em lotes que gravam cada bloco de inode uma única vez.
+// Retorna quantos inodes foram criados e os inumbers em inumbers
+int INE5412_FS::fs_create_many(int n, std::vector<int> &inumbers)
+{
+    Op_Timer timer(op_stats[OP_CREATE]);
+    //checa se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    inumbers.clear();
+    while ((int)inumbers.size() < n && create_batch(n - inumbers.size(), inumbers)) {
+    }
+    if ((int)inumbers.size() < n) {
+        cerr << "ERROR: inode table is full" << endl;
+    }
+    return inumbers.size();
+}
+
+// função auxiliar do fs_create_many que cria, numa operação, até n inodes,
+// acrescentados a inumbers. Os inodes de um lote ficam em no máximo dois blocos
+// de inode e dois blocos do mapa, o que cabe na reserva de uma operação no
+// journal (ver journal_op_blocks). Retorna quantos inodes foram criados
+int INE5412_FS::create_batch(int n, std::vector<int> &inumbers)
+{
+    journal_handle handle(this);
+    std::size_t first = inumbers.size();
+    int blocks = 0, maps = 0;
+    int last_block = -1, last_map = -1;
+
+    // reserva os inodes no mapa, em ordem crescente a partir do cursor; se acabar
+    // no fim da tabela, volta para o início
+    std::unique_lock<std::mutex> alloc_guard(alloc_lock);
+    int start[2] = { inode_cursor, 1 };
+    bool full = false;
+    for (int pass = 0; pass < 2 && !full; pass++) {
+        int inumber = start[pass];
+        while ((int)(inumbers.size() - first) < n && (inumber = finodes_bitmap.find_first_free(inumber)) >= 0) {
+            int block = (inumber - 1) / INODES_PER_BLOCK;
+            int map = inumber / BITS_PER_BLOCK;
+            if ((block != last_block && blocks == 2) || (map != last_map && maps == 2)) {
+                full = true;
+                break;
+            }
+            blocks += block != last_block;
+            maps += map != last_map;
+            last_block = block;
+            last_map = map;
+
+            inode_mark(inumber, true);
+            inumbers.push_back(inumber);
+            inumber++;
+        }
+    }
+    if (inumbers.size() == first) {
+        return 0;
+    }
+    inode_cursor = inumbers.back() + 1;
+    alloc_guard.unlock();
+
+    // inicializa os inodes e grava os blocos de inode alterados de uma vez
+    std::unique_lock<std::mutex> table_guard(table_lock);
+    for (std::size_t i = first; i < inumbers.size(); i++) {
+        int block_number = 1 + (inumbers[i] - 1) / INODES_PER_BLOCK;
+        fs_inode &inode = inode_block(block_number)->inode[(inumbers[i] - 1) % INODES_PER_BLOCK];
+
+        inode.isvalid = 1;
+        inode.size = 0;
+        for (int k = 0; k < POINTERS_PER_INODE; k++) {
+            inode.direct[k] = 0;
+        }
+        inode.indirect = 0;
+        inode_touch(block_number);
+    }
+    inode_flush();
+    table_guard.unlock();
+
+    bitmap_save();
+    return inumbers.size() - first;
+}
+
+int INE5412_FS::fs_delete(int inumber)
+{
+    Op_Timer timer(op_stats[OP_DELETE]);
+    // verifica se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    journal_handle handle(this);
+    std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    fs_inode inode;
+    inode_load(inumber, &inode); // carrega o inode pelo inumber
+
+    // se o inumber for inválido, retorna erro
+    if (!inode.isvalid) {
+        cerr << "ERROR: Invalid inumber" << endl;
+        return 0;
+    }
+
+    buffer_drop(inumber);      // o que ainda estava no buffer nem chegou a ter blocos
+    std::vector<int> freed;    // blocos do arquivo, devolvidos ao bitmap no fim
+    file_blocks(inode, freed);
+
+    // os blocos de mapa (de ponteiros ou overflow) saem do cache de mapas
+    for (std::size_t i = 0; i < freed.size(); i++) {
+        map_update(freed[i], 0);
+    }
+
+    inode.isvalid = 0;  // bota o inode como inválido
+    inode.size = 0; // bota o tamanho do inode como 0
+    for (int i = 0; i <= POINTERS_PER_INODE; i++) {
+        inode.pointers[i] = 0;  // zera os ponteiros (ou os extents)
+    }
+
+    inode_save(inumber, &inode);    // salva o inode
+    release_blocks(freed);          // devolve os blocos para o bitmap
+
+    // devolve o inode para o bitmap
+    {
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        inode_mark(inumber, false);    // marca o inode como livre
+        if (inumber < inode_cursor) {
+            inode_cursor = inumber; // o cursor fica sempre no menor inode livre conhecido
+        }
+    }
+    bitmap_save();
+
+	return 1;
+}
+
+// libera os blocos do intervalo [offset, offset + length) do arquivo, que passa
+// a ter um buraco ali: o fs_read devolve zeros e os blocos voltam para o bitmap
+// (e viram buracos na imagem, como no fs_delete). O tamanho não muda. Os blocos
+// cortados nas pontas do intervalo continuam alocados, com a parte dentro dele
+// zerada, e os blocos de ponteiros que ficam vazios também são liberados
+int INE5412_FS::fs_punch(int inumber, int offset, int length)
+{
+    Op_Timer timer(op_stats[OP_PUNCH]);
+    // verifica se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    journal_handle handle(this);
+    std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    fs_inode inode;
+    inode_load(inumber, &inode); // carrega o inode pelo inumber
+
+    // se o inumber for inválido, retorna erro
+    if (!inode.isvalid) {
+        cerr << "ERROR: Invalid inumber" << endl;
+        return 0;
+    }
+
+    // se o intervalo for inválido, retorna erro
+    if (offset < 0 || length < 0) {
+        cerr << "ERROR: invalid range" << endl;
+        return 0;
+    }
+
+    // o buffer de escrita vai para o disco antes, e o intervalo para no fim do arquivo
+    buffer_flush_locked(inumber, inode);
+    int end = (int)min((long)offset + length, (long)inode.size);
+    if (offset >= end) {
+        return 1;
+    }
+
+    // arquivo dentro do inode: só zera os bytes
+    if (inode.isvalid == INODE_INLINE) {
+        memset(inode.data + offset, 0, end - offset);
+        inode_save(inumber, &inode);
+        timer.bytes = end - offset;
+        return 1;
+    }
+
+    // blocos lógicos inteiros dentro do intervalo
+    int first = (offset + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE;
+    int last = end / Disk::DISK_BLOCK_SIZE - 1;
+    if (end == inode.size) {
+        last = (end - 1) / Disk::DISK_BLOCK_SIZE;   // o último bloco do arquivo sai mesmo se cortado
+    }
+
+    // zera as pontas cortadas; nos buracos, o write_data não aloca nada
+    static const char zeros[Disk::DISK_BLOCK_SIZE] = { 0 };
+    int head_end = min(end, first * Disk::DISK_BLOCK_SIZE);
+    if (offset < head_end) {
+        write_data(inumber, inode, zeros, head_end - offset, offset);
+    }
+    int tail_start = max(head_end, (last + 1) * Disk::DISK_BLOCK_SIZE);
+    if (tail_start < end) {
+        write_data(inumber, inode, zeros, end - tail_start, tail_start);
+    }
+
+    std::vector<int> freed;
+    if (first <= last) {
+        punch_blocks(inumber, inode, first, last, freed);
+    }
+
+    // os blocos de mapa liberados saem do cache de mapas
+    for (std::size_t i = 0; i < freed.size(); i++) {
+        map_update(freed[i], 0);
+    }
+
+    inode_save(inumber, &inode);
+    release_blocks(freed);
+    bitmap_save();
+
+    timer.bytes = end - offset;
+    return 1;
+}
+
+// função auxiliar que tira do arquivo os blocos lógicos [first, last] e junta
+// em freed os blocos de dados e os de ponteiros que ficaram vazios. Chamada com
+// o inode travado para escrita, que é alterado mas não gravado
+void INE5412_FS::punch_blocks(int inumber, fs_inode &inode, int first, int last, std::vector<int> &freed)
+{
+    if (extents()) {
+        std::vector<fs_extent> ext;
+        std::vector<int> mapped;
+        extents_load(inode, ext);
+        resolve_blocks(inode, first, last - first + 1, mapped);
+
+        // cada bloco vira buraco, e os buracos vizinhos se juntam num extent só
+        for (int b = first; b <= last; b++) {
+            if (!mapped[b - first]) {
+                continue;
+            }
+            // sem espaço para dividir mais os extents, o resto do intervalo só é
+            // zerado, sem passar do fim do arquivo no último bloco
+            if (!extent_add(inode, ext, b, 0)) {
+                extents_store(inode, ext);
+                static const char zeros[Disk::DISK_BLOCK_SIZE] = { 0 };
+                for (int z = b; z <= last; z++) {
+                    int start = z * Disk::DISK_BLOCK_SIZE;
+                    int end = min(start + Disk::DISK_BLOCK_SIZE, inode.size);
+                    if (mapped[z - first] && end > start) {
+                        write_data(inumber, inode, zeros, end - start, start);
+                    }
+                }
+                return;
+            }
+            freed.push_back(mapped[b - first]);
+        }
+        extents_store(inode, ext);
+        return;
+    }
+
+    // os blocos diretos, e depois a parte do intervalo em cada nível de indireção
+    for (int b = first; b <= last && b < tree_direct(); b++) {
+        if (inode.pointers[b]) {
+            freed.push_back(inode.pointers[b]);
+            inode.pointers[b] = 0;
+        }
+    }
+
+    long base = tree_direct();  // primeiro bloco lógico alcançado pelo nível
+    long span = 1;
+    for (int level = 1; level <= tree_levels() && base <= last; level++) {
+        span *= POINTERS_PER_BLOCK;
+        int &root = inode.pointers[tree_direct() + level - 1];
+        if (root && first < base + span) {
+            long from = max((long)first, base) - base;
+            long to = min((long)last, base + span - 1) - base;
+            if (tree_punch(root, level, from, to, freed)) {
+                root = 0;
+            }
+        }
+        base += span;
+    }
+}
+
+// função auxiliar que tira os blocos de dados [first, last], contados a partir
+// do primeiro alcançado pelo bloco de ponteiros blocknum, que fica height
+// níveis acima dos dados. Junta em freed os blocos tirados e os de ponteiros
+// que ficaram vazios; retorna true se o próprio blocknum ficou vazio (e foi para
+// freed), senão grava o bloco, se tiver mudado
+bool INE5412_FS::tree_punch(int blocknum, int height, long first, long last, std::vector<int> &freed)
+{
+    union fs_block block;
+    meta_read(blocknum, block.data);
+
+    long span = 1;  // blocos de dados alcançados por cada ponteiro
+    for (int k = 1; k < height; k++) {
+        span *= POINTERS_PER_BLOCK;
+    }
+
+    bool changed = false;
+    bool empty = true;
+    for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+        long lo = i * span;
+        long hi = lo + span - 1;
+        int child = block.pointers[i];
+
+        if (child && lo <= last && hi >= first) {
+            if (height == 1) {
+                freed.push_back(child);
+                block.pointers[i] = 0;
+            } else if (first <= lo && hi <= last) {
+                tree_collect(child, height - 1, freed, &freed);    // subárvore inteira dentro do intervalo
+                block.pointers[i] = 0;
+            } else if (tree_punch(child, height - 1, max(first - lo, 0L), min(last - lo, span - 1), freed)) {
+                block.pointers[i] = 0;
+            }
+            changed |= !block.pointers[i];
+        }
+        empty &= !block.pointers[i];
+    }
+
+    if (empty) {
+        freed.push_back(blocknum);
+        return true;
+    }
+    if (changed) {
+        meta_write(blocknum, block.data);
+        map_update(blocknum, &block);
+    }
+    return false;
+}
+
+// função auxiliar que devolve ao bitmap blocos tirados de um arquivo, depois que
+// o inode sem eles foi gravado. Com journal, os blocos só são devolvidos depois
+// que a transação com o inode chegar ao disco (ver journal_commit)
+void INE5412_FS::release_blocks(std::vector<int> &freed)
+{
+    if (journaling()) {
+        std::lock_guard<std::mutex> guard(journal_lock);
+        journal_freed.insert(journal_freed.end(), freed.begin(), freed.end());
+        freed.clear();
+    }
+
+    // os buracos são abertos antes de devolver os blocos, que podem ser realocados logo em seguida
+    if (discard_freed) {
+        discard_blocks(freed);
+    }
+
+    std::lock_guard<std::mutex> guard(alloc_lock);
+    for (std::size_t i = 0; i < freed.size(); i++) {
+        block_mark(freed[i], false);
+    }
+}
+
+// função auxiliar que junta em blocks todos os blocos do arquivo: os de dados e
+// os de mapa (o bloco indireto ou o overflow)
+void INE5412_FS::file_blocks(fs_inode &inode, std::vector<int> &blocks)
+{
+    if (inode.isvalid == INODE_INLINE) {
+        return;
+    }
+    if (extents()) {
+        std::vector<fs_extent> ext;
+        extents_load(inode, ext);
+        for (std::size_t i = 0; i < ext.size(); i++) {
+            for (int b = 0; ext[i].start && b < ext[i].length; b++) {
+                blocks.push_back(ext[i].start + b);
+            }
+        }
+        if (inode.overflow) {
+            blocks.push_back(inode.overflow);
+        }
+        return;
+    }
+
+    // os blocos diretos, e os blocos de dados e de ponteiros de cada nível de indireção
+    for (int i = 0; i < tree_direct(); i++) {
+        if (inode.pointers[i]) {
+            blocks.push_back(inode.pointers[i]);
+        }
+    }
+    for (int level = 1; level <= tree_levels(); level++) {
+        int root = inode.pointers[tree_direct() + level - 1];
+        if (root) {
+            tree_collect(root, level, blocks, &blocks);
+        }
+    }
+}
+
+// função auxiliar que junta em data os blocos de dados alcançados pelo bloco de
+// ponteiros blocknum, que fica height níveis acima dos dados, e em nodes (se não
+// for 0) os blocos de ponteiros do caminho, incluindo o próprio blocknum
+void INE5412_FS::tree_collect(int blocknum, int height, std::vector<int> &data, std::vector<int> *nodes)
+{
+    union fs_block block;
+    meta_read(blocknum, block.data);
+
+    for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+        if (!block.pointers[i]) {
+            continue;
+        }
+        if (height > 1) {
+            tree_collect(block.pointers[i], height - 1, data, nodes);
+        } else {
+            data.push_back(block.pointers[i]);
+        }
+    }
+    if (nodes) {
+        nodes->push_back(blocknum);
+    }
+}
+
+// função auxiliar que abre buracos na imagem no lugar dos blocos, juntando os consecutivos
+void INE5412_FS::discard_blocks(std::vector<int> &blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+
+    for (std::size_t i = 0; i < blocks.size(); ) {
+        std::size_t j = i + 1;
+        while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1) {
+            j++;
+        }
+        cache.discard(blocks[i], j - i);
+        i = j;
+    }
+}
+
+int INE5412_FS::fs_getsize(int inumber)
+{
+    Op_Timer timer(op_stats[OP_GETSIZE]);
+    // verifica se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    fs_inode inode;
+    inode_load(inumber, &inode);    //carrega o inode pelo inumber
+
+    // se inode for válido, retorna o tamanho do inode, contando o buffer de escrita
+    if (inode.isvalid) {
+        return buffer_size(inumber, inode.size);
+    }
+
+    //se o inumber for inválido, retorna erro
+    cerr << "ERROR: Invalid inumber" << endl;
+	return -1;
+}
+
+int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
+{
+    Op_Timer timer(op_stats[OP_READ]);
+    // verifica se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    // o que estiver no buffer de escrita vai para o disco antes
+    if (write_buffered) {
+        buffer_flush(inumber);
+    }
+
+    // leitores do mesmo arquivo rodam em paralelo, só um fs_write/fs_delete os bloqueia
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    fs_inode inode;
+
+    // carrega o inode correspondente ao inumber
+    inode_load(inumber, &inode);
+
+    // se o inumber for inválido, retorna erro
+    if(!inode.isvalid) {
+        cerr << "ERROR: Invalid inumber" << endl;
+        return 0;
+    }
+
+    int inode_size = inode.size;
+
+    // se o offset for negativo ou maior ao tamanho do inode, retorna erro
+    if (offset < 0 || offset > inode_size) {
+        cerr << "ERROR: offset is greater than inode size" << endl;
+        return 0;
+    }
+
+    // se o tamanho do inode for 0, retorna erro
+    if (inode_size == 0) {
+        cerr << "ERROR: inode size is 0" << endl;
+        return 0;
+    }
+
+
+    int length_to_read = min(length, inode_size - offset);  // calcula o tamanho de bytes a serem lidos
+    if (length_to_read <= 0) {
+        return 0;
+    }
+
+    // arquivo dentro do inode: nada mais a ler
+    if (inode.isvalid == INODE_INLINE) {
+        memcpy(data, inode.data + offset, length_to_read);
+        timer.bytes = length_to_read;
+        return length_to_read;
+    }
+
+    // resolve os blocos físicos de todo o intervalo de uma vez, lendo o bloco indireto no máximo uma vez
+    int first_block = offset / Disk::DISK_BLOCK_SIZE;
+    int last_block = (offset + length_to_read - 1) / Disk::DISK_BLOCK_SIZE;
+    std::vector<int> blocks;
+    resolve_blocks(inode, first_block, last_block - first_block + 1, blocks);
+
+    // lê todos os blocos alocados do intervalo numa leitura vetorizada. Os blocos
+    // cobertos inteiros pela leitura vão direto para o buffer do chamador; só o
+    // primeiro e o último, se estiverem cortados, passam por um buffer intermediário
+    union fs_block partial[2];
+    std::vector<Disk::block_io> ios;
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i]) {
+            int block_start = (first_block + i) * Disk::DISK_BLOCK_SIZE - offset;  // posição do bloco no buffer do chamador
+            Disk::block_io io;
+            io.blocknum = blocks[i];
+            if (block_start >= 0 && block_start + Disk::DISK_BLOCK_SIZE <= length_to_read) {
+                io.data = data + block_start;
+            } else {
+                io.data = partial[i == 0 ? 0 : 1].data;
+            }
+            ios.push_back(io);
+        }
+    }
+
+    // se a leitura continua a anterior, carrega os próximos blocos no cache junto
+    std::vector<int> ahead;
+    readahead(inumber, inode, offset, length_to_read, ahead);
+    cache.read_blocks(ios, ahead);
+
+    int bytes_read = 0; // contador de bytes lidos
+
+    // loop para copiar os blocos cortados e zerar os buracos
+    while (bytes_read < length_to_read) {
+
+        int curr_offset = offset + bytes_read;  // offset atual
+        int block_i = curr_offset / Disk::DISK_BLOCK_SIZE;  // índice do bloco
+        int block_offset = curr_offset % Disk::DISK_BLOCK_SIZE; // offset do bloco
+
+        int block_num = blocks[block_i - first_block];  // armazena o indice do bloco lido
+
+        int bytes_to_read = min(length_to_read - bytes_read, Disk::DISK_BLOCK_SIZE - block_offset); // calcula o tamanho de bytes a serem lidos
+
+        // se o bloco for diferente de 0 e estiver cortado, copia do buffer intermediário
+        if (block_num == 0) {
+            memset(data + bytes_read, 0, bytes_to_read);  
+        }
+        else if (bytes_to_read != Disk::DISK_BLOCK_SIZE) {
+            memcpy(data + bytes_read, partial[block_i == first_block ? 0 : 1].data + block_offset, bytes_to_read);    // copia os dados para o buffer
+        }
+
+        bytes_read += bytes_to_read;    // incrementa o contador de bytes lidos 
+#ifdef FS_TRACE
+        cout << "interation: " << bytes_read << endl;
+
+        cout<< "block_i: " << block_i << endl;
+#endif
+    }
+    timer.bytes = bytes_read;
+    return bytes_read;  // retorna a quantidade de bytes lidos
+}
+
+// lê sem copiar: devolve em views ponteiros só de leitura para os dados do
+// intervalo, que apontam para o cache de blocos ou para a imagem mapeada. Os
+// blocos do cache ficam presos (não são substituídos) até as views serem
+// soltas pelo fs_release_view ou passadas de novo ao fs_read_view, que solta
+// as anteriores. Uma escrita no arquivo nesse meio tempo aparece nas views.
+// Sem a imagem mapeada, cada chamada cobre no máximo metade do cache, e as
+// views presas de todas as threads juntas não devem passar do tamanho do
+// cache; retorna quantos bytes as views cobrem (pode ser menos que length,
+// como no fs_read)
+int INE5412_FS::fs_read_view(int inumber, std::vector<fs_view> &views, int length, int offset)
+{
+    Op_Timer timer(op_stats[OP_READ]);
+    static const char zeros[Disk::DISK_BLOCK_SIZE] = { 0 };    // conteúdo dos buracos
+
+    fs_release_view(views);
+
+    // verifica se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    if (write_buffered) {
+        buffer_flush(inumber);
+    }
+
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+    fs_inode inode;
+    inode_load(inumber, &inode);
+
+    // se o inumber for inválido, retorna erro
+    if (!inode.isvalid) {
+        cerr << "ERROR: Invalid inumber" << endl;
+        return 0;
+    }
+
+    // se o offset for maior ao tamanho do inode, retorna erro
+    if (offset < 0 || offset > inode.size) {
+        cerr << "ERROR: offset is greater than inode size" << endl;
+        return 0;
+    }
+
+    int length_to_read = min(length, inode.size - offset);
+    if (length_to_read <= 0) {
+        return 0;
+    }
+
+    // arquivo dentro do inode: a view aponta para a tabela de inodes na memória
+    if (inode.isvalid == INODE_INLINE) {
+        std::lock_guard<std::mutex> guard(table_lock);
+        fs_view view;
+        view.data = inode_block(1 + (inumber - 1) / INODES_PER_BLOCK)->inode[(inumber - 1) % INODES_PER_BLOCK].data + offset;
+        view.length = length_to_read;
+        views.push_back(view);
+        timer.bytes = length_to_read;
+        return length_to_read;
+    }
+
+    int first_block = offset / Disk::DISK_BLOCK_SIZE;
+    int last_block = (offset + length_to_read - 1) / Disk::DISK_BLOCK_SIZE;
+
+    // os blocos carregados no cache por esta chamada não podem expulsar uns aos outros
+    if (!disk->mapped() && last_block - first_block + 1 > max(cache.size() / 2, 1)) {
+        last_block = first_block + max(cache.size() / 2, 1) - 1;
+        length_to_read = (last_block + 1) * Disk::DISK_BLOCK_SIZE - offset;
+    }
+
+    std::vector<int> blocks;
+    resolve_blocks(inode, first_block, last_block - first_block + 1, blocks);
+
+    // sem a imagem mapeada, carrega no cache os blocos que faltam numa única leitura vetorizada
+    if (!disk->mapped()) {
+        std::vector<int> missing;
+        std::vector<Disk::block_io> none;
+        for (std::size_t i = 0; i < blocks.size(); i++) {
+            if (blocks[i]) {
+                missing.push_back(blocks[i]);
+            }
+        }
+        cache.read_blocks(none, missing);
+    }
+
+    int bytes_read = 0;
+    while (bytes_read < length_to_read) {
+        int curr_offset = offset + bytes_read;
+        int block_i = curr_offset / Disk::DISK_BLOCK_SIZE;
+        int block_offset = curr_offset % Disk::DISK_BLOCK_SIZE;
+        int block_num = blocks[block_i - first_block];
+        int bytes_to_read = min(length_to_read - bytes_read, Disk::DISK_BLOCK_SIZE - block_offset);
+
+        // prefere a cópia do cache, que pode ser mais nova que a do disco
+        const char *block = zeros;
+        if (block_num) {
+            block = cache.pointer(block_num, false, true);
+            if (!block) {
+                block = disk->block_pointer(block_num);
+            }
+            if (!block) {
+                block = cache.pointer(block_num, true, true);
+            }
+        }
+
+        // junta com a view anterior se os dados forem contíguos na memória
+        const char *ptr = block + block_offset;
+        if (!views.empty() && block != zeros && views.back().data + views.back().length == ptr) {
+            views.back().length += bytes_to_read;
+        } else {
+            fs_view view;
+            view.data = ptr;
+            view.length = bytes_to_read;
+            views.push_back(view);
+        }
+
+        bytes_read += bytes_to_read;
+    }
+    timer.bytes = bytes_read;
+    return bytes_read;
+}
+
+// solta os blocos do cache presos pelas views do fs_read_view e esvazia views
+void INE5412_FS::fs_release_view(std::vector<fs_view> &views)
+{
+    for (std::size_t i = 0; i < views.size(); i++) {
+        cache.unpin(views[i].data, views[i].length);
+    }
+    views.clear();
+}
+
+// função auxiliar que detecta leitura sequencial do inode e devolve em ahead
+// os próximos blocos físicos a serem carregados antecipadamente. A janela de
+// readahead começa em READAHEAD_MIN blocos e dobra a cada leitura sequencial;
+// um acesso fora de ordem desliga o readahead do inode
+void INE5412_FS::readahead(int inumber, fs_inode &inode, int offset, int length, std::vector<int> &ahead)
+{
+    int victim = 0;
+    int i;
+
+    std::lock_guard<std::mutex> guard(ra_lock);
+    ahead.clear();
+    ra_tick++;
+
+    // procura o estado do inode, ou substitui o usado há mais tempo
+    for (i = 0; i < (int)ra_streams.size(); i++) {
+        if (ra_streams[i].inumber == inumber) {
+            break;
+        }
+        if (ra_streams[i].used < ra_streams[victim].used) {
+            victim = i;
+        }
+    }
+    if (i == (int)ra_streams.size()) {
+        i = victim;
+        ra_streams[i] = ra_stream();
+        ra_streams[i].inumber = inumber;
+    }
+    ra_stream &ra = ra_streams[i];
+    ra.used = ra_tick;
+
+    if (offset == ra.next_offset) {
+        ra.window = ra.window ? min(ra.window * 2, ra_max) : READAHEAD_MIN;
+    } else {
+        ra.window = 0;  // acesso aleatório
+        ra.ahead_end = 0;
+    }
+    ra.next_offset = offset + length;
+
+    if (!ra.window) {
+        return;
+    }
+
+    // carrega os blocos depois do fim desta leitura que ainda não foram carregados
+    int last_block = (offset + length - 1) / Disk::DISK_BLOCK_SIZE;
+    int file_blocks = (inode.size + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE;
+    int from = max(last_block + 1, ra.ahead_end);
+    int to = min(last_block + ra.window, file_blocks - 1);
+
+    if (from > to) {
+        return;
+    }
+
+    std::vector<int> blocks;
+    resolve_blocks(inode, from, to - from + 1, blocks);
+    for (std::size_t j = 0; j < blocks.size(); j++) {
+        if (blocks[j]) {
+            ahead.push_back(blocks[j]);
+        }
+    }
+    ra.ahead_end = to + 1;
+}
+
+// função auxiliar que resolve os blocos físicos dos blocos lógicos [first, first+count) do inode
+void INE5412_FS::resolve_blocks(fs_inode &inode, int first, int count, std::vector<int> &blocks)
+{
+    std::lock_guard<std::mutex> guard(map_lock);
+
+    // no formato de extents, percorre os extents até o fim do intervalo
+    if (extents()) {
+        fs_extent *overflow = 0;    // extents do bloco overflow, carregados só se precisar
+        int logical = 0;    // primeiro bloco lógico do extent
+
+        blocks.assign(count, 0);
+        for (int e = 0; e < min(inode.nextents, INODE_EXTENTS + EXTENTS_PER_BLOCK) && logical < first + count; e++) {
+            if (e >= INODE_EXTENTS && !overflow) {
+                overflow = map_block(inode.overflow)->extents;
+            }
+            fs_extent &x = e < INODE_EXTENTS ? inode.extents[e] : overflow[e - INODE_EXTENTS];
+
+            for (int b = max(logical, first); x.start && b < min(logical + x.length, first + count); b++) {
+                blocks[b - first] = x.start + (b - logical);
+            }
+            logical += x.length;
+        }
+        return;
+    }
+
+    // nos formatos com ponteiros, desce pela árvore só quando o bloco lógico cai
+    // num bloco de ponteiros do último nível diferente do bloco anterior
+    int *leaf = 0;          // ponteiros do último nível usados pelo bloco anterior
+    int leaf_level = -1;
+    int leaf_index[INDIRECT_LEVELS];
+    int index[INDIRECT_LEVELS];
+
+    blocks.resize(count);
+    for (int i = 0; i < count; i++) {
+        int block_i = first + i;
+        int level = tree_locate(block_i, index);
+
+        if (level <= 0) {
+            blocks[i] = level == 0 ? inode.pointers[block_i] : 0;
+            continue;
+        }
+
+        if (level != leaf_level || !std::equal(index, index + level - 1, leaf_index)) {
+            int blk = inode.pointers[tree_direct() + level - 1];
+            for (int k = 0; blk && k < level - 1; k++) {
+                blk = map_block(blk)->pointers[index[k]];
+            }
+            leaf = blk ? map_block(blk)->pointers : 0;
+            leaf_level = level;
+            std::copy(index, index + level, leaf_index);
+        }
+        blocks[i] = leaf ? leaf[index[level - 1]] : 0;
+    }
+}
+
+// função auxiliar que acha o bloco lógico block_i na árvore de ponteiros do
+// inode: retorna 0 se ele é um bloco direto, o nível de indireção (1 = indireto,
+// 2 = duplo, 3 = triplo) com o índice seguido em cada bloco de ponteiros em
+// index, ou -1 se passar do tamanho máximo
+int INE5412_FS::tree_locate(int block_i, int *index)
+{
+    if (block_i < tree_direct()) {
+        return block_i < 0 ? -1 : 0;
+    }
+
+    long b = block_i - tree_direct();
+    long span = 1;  // blocos alcançados por uma raiz do nível
+    for (int level = 1; level <= tree_levels(); level++) {
+        span *= POINTERS_PER_BLOCK;
+        if (b < span) {
+            for (int k = level - 1; k >= 0; k--) {
+                index[k] = b % POINTERS_PER_BLOCK;
+                b /= POINTERS_PER_BLOCK;
+            }
+            return level;
+        }
+        b -= span;
+    }
+    return -1;
+}
+
+// função auxiliar que retorna o n máximo de blocos de um arquivo nos formatos
+// com ponteiros, limitado pelo tamanho em bytes caber num int
+int INE5412_FS::tree_max_blocks()
+{
+    long total = tree_direct();
+    long span = 1;
+    for (int level = 1; level <= tree_levels(); level++) {
+        span *= POINTERS_PER_BLOCK;
+        total += span;
+    }
+    return min(total, (long)(INT_MAX / Disk::DISK_BLOCK_SIZE));
+}
 
-        int curr_offset = offset + bytes_read;  // offset atual
-        int block_i = curr_offset / Disk::DISK_BLOCK_SIZE;  // índice do bloco
-        int block_offset = curr_offset % Disk::DISK_BLOCK_SIZE; // offset do bloco
+// função auxiliar que conta quantos blocos o fs_write precisa alocar para os
+// blocos lógicos [first, last]: os de dados que faltam e os de ponteiros que
+// ainda não existem no caminho até eles, cada um contado uma vez. Os blocos
+// marcados em zero (zero[b - first]) continuam buracos e não contam
+int INE5412_FS::tree_missing(fs_inode &inode, int first, int last, const std::vector<char> &zero)
+{
+    std::lock_guard<std::mutex> guard(map_lock);
+    int missing = 0;
+    int prev_level = -1;
+    int prev_index[INDIRECT_LEVELS];
+    int index[INDIRECT_LEVELS];
+
+    for (int b = first; b <= last; b++) {
+        if (zero[b - first]) {
+            continue;
+        }
+        int level = tree_locate(b, index);
+        if (level < 0) {
+            break;
+        }
+        if (level == 0) {
+            missing += !inode.pointers[b];
+            continue;
+        }
 
-        int block_num = get_dblocknum(inode, block_i);  // armazena o indice do bloco a ser lido
+        // profundidades até same usam os mesmos blocos de ponteiros que o bloco anterior
+        int same = -1;
+        if (level == prev_level) {
+            same = 0;
+            while (same < level - 1 && index[same] == prev_index[same]) {
+                same++;
+            }
+        }
 
-        int bytes_to_read = min(length_to_read - bytes_read, Disk::DISK_BLOCK_SIZE - block_offset); // calcula o tamanho de bytes a serem lidos
+        int blk = inode.pointers[tree_direct() + level - 1];
+        for (int k = 0; k < level; k++) {
+            if (!blk) {
+                missing += k > same;    // bloco de ponteiros novo, contado no primeiro bloco que passa por ele
+            } else {
+                blk = map_block(blk)->pointers[index[k]];
+            }
+        }
+        missing += !blk;
 
-        // se o bloco for diferente de 0, lê o bloco
-        if (block_num != 0) {
-            union fs_block block;
-            disk->read(block_num, block.data);  // lê o bloco
+        prev_level = level;
+        std::copy(index, index + level, prev_index);
+    }
+    return missing;
+}
 
-            memcpy(data + bytes_read, block.data + block_offset, bytes_to_read);    // copia os dados para o buffer
+// função auxiliar que retorna o bloco físico do bloco lógico block_i, criando os
+// blocos de ponteiros que faltam no caminho e o próprio bloco de dados com os
+// blocos de pool (a partir de next), nessa ordem. Os blocos de ponteiros do
+// caminho ficam alterados em path até o tree_flush. Retorna 0 se pool acabar
+int INE5412_FS::tree_block(tree_path &path, fs_inode &inode, int block_i, std::vector<int> &pool, int &next, bool &fresh)
+{
+    int index[INDIRECT_LEVELS];
+    int level = tree_locate(block_i, index);
+    int *slot;
+
+    fresh = false;
+    if (level < 0) {
+        return 0;
+    }
+
+    if (level == 0) {
+        slot = &inode.pointers[block_i];
+    } else {
+        // profundidades até same continuam valendo; as outras são gravadas e trocadas
+        int same = -1;
+        if (level == path.level) {
+            same = 0;
+            while (same < level - 1 && index[same] == path.index[same]) {
+                same++;
+            }
         }
-        else {
-            memset(data + bytes_read, 0, bytes_to_read);  
+        tree_flush(path, same + 1);
+
+        for (int k = same + 1; k < level; k++) {
+            int *parent = k == 0 ? &inode.pointers[tree_direct() + level - 1] : &path.node[k - 1].block.pointers[index[k - 1]];
+            tree_node &node = path.node[k];
+
+            if (*parent) {
+                std::lock_guard<std::mutex> guard(map_lock);
+                node.blocknum = *parent;
+                node.dirty = false;
+                node.block = *map_block(*parent);
+            } else {
+                if (next == (int)pool.size()) {
+                    path.level = k;     // só as profundidades já carregadas são gravadas
+                    return 0;
+                }
+                *parent = pool[next++];
+                if (k > 0) {
+                    path.node[k - 1].dirty = true;
+                }
+                node.blocknum = *parent;
+                node.dirty = true;
+                memset(node.block.data, 0, Disk::DISK_BLOCK_SIZE);
+            }
         }
+        path.level = level;
+        std::copy(index, index + level, path.index);
+        slot = &path.node[level - 1].block.pointers[index[level - 1]];
+    }
 
-        bytes_read += bytes_to_read;    // incrementa o contador de bytes lidos 
-        cout << "interation: " << bytes_read << endl;
+    if (!*slot) {
+        if (next == (int)pool.size()) {
+            return 0;
+        }
+        *slot = pool[next++];
+        fresh = true;
+        if (level > 0) {
+            path.node[level - 1].dirty = true;
+        }
+    }
+    return *slot;
+}
 
-        cout<< "block_i: " << block_i << endl;
+// função auxiliar que grava os blocos de ponteiros alterados do caminho, da profundidade from em diante
+void INE5412_FS::tree_flush(tree_path &path, int from)
+{
+    for (int k = max(from, 0); k < path.level; k++) {
+        if (path.node[k].dirty) {
+            meta_write(path.node[k].blocknum, path.node[k].block.data);
+            map_update(path.node[k].blocknum, &path.node[k].block);
+            path.node[k].dirty = false;
+        }
     }
-    return bytes_read;  // retorna a quantidade de bytes lidos
 }
 
+// função auxiliar que retorna um bloco de mapa (indireto ou overflow) guardado no
+// cache de mapas, lendo do disco só se ele não estiver lá. O cache é pequeno e
+// mantém os mapas dos últimos arquivos acessados entre chamadas de fs_read.
+// Chamada com o map_lock, e o bloco só vale enquanto ele estiver com o chamador
+INE5412_FS::fs_block *INE5412_FS::map_block(int blocknum)
+{
+    int victim = 0;
+
+    map_tick++;
+    for (std::size_t i = 0; i < map_cache.size(); i++) {
+        if (map_cache[i].blocknum == blocknum) {
+            map_cache[i].used = map_tick;
+            map_hits++;
+            return &map_cache[i].block;
+        }
+        if (map_cache[i].used < map_cache[victim].used) {
+            victim = i;
+        }
+    }
+
+    // substitui a entrada usada há mais tempo
+    map_misses++;
+    map_cache[victim].blocknum = blocknum;
+    map_cache[victim].used = map_tick;
+    meta_read(blocknum, map_cache[victim].block.data);
+    return &map_cache[victim].block;
+}
+
+// função auxiliar que mantém o cache de mapas igual ao bloco de ponteiros gravado
+void INE5412_FS::map_update(int blocknum, const fs_block *block)
+{
+    std::lock_guard<std::mutex> guard(map_lock);
+    for (std::size_t i = 0; i < map_cache.size(); i++) {
+        if (map_cache[i].blocknum == blocknum) {
+            if (block) {
+                map_cache[i].block = *block;
+            } else {
+                map_cache[i].blocknum = 0;  // bloco liberado, descarta a entrada
+                map_cache[i].used = 0;
+            }
+        }
+    }
+}
+
+// função auxiliar que reserva n blocos livres no bitmap, começando em goal e
+// preferindo uma sequência contígua. Retorna quantos blocos foram reservados
+// (pode ser menos que n se o disco estiver cheio). Os blocos prometidos aos
+// buffers de escrita (reserved_blocks) não contam como livres, a não ser os de
+// *reserved, a reserva de quem está gravando um buffer, que diminui com os
+// blocos usados
+int INE5412_FS::allocate_blocks(int n, int goal, std::vector<int> &blocks, int *reserved)
+{
+    int first_data = data_start();  // primeiro bloco depois da tabela de inodes e dos bitmaps
+    std::lock_guard<std::mutex> guard(alloc_lock);
+
+    blocks.clear();
+    int own = reserved ? *reserved : 0;
+    n = min(n, fblocks_bitmap.count_free() - reserved_blocks + own);
+    if (n <= 0) {
+        return 0;
+    }
+    if (goal < first_data || goal >= fblocks_bitmap.size()) {
+        goal = first_data;
+    }
+
+    // procura uma sequência contígua depois de goal, e depois desde o início
+    int start = fblocks_bitmap.find_free_run(n, goal);
+    if (start < 0 && goal != first_data) {
+        start = fblocks_bitmap.find_free_run(n, first_data);
+    }
+
+    if (start >= 0) {
+        for (int j = 0; j < n; j++) {
+            blocks.push_back(start + j);
+        }
+    } else {
+        // sem sequência livre, pega os blocos livres a partir de goal e depois os
+        // do início até goal. Os blocos só são marcados no fim, então cada trecho
+        // do bitmap é percorrido uma vez só, sem dar a volta
+        int b = goal;
+        while ((int)blocks.size() < n && (b = fblocks_bitmap.find_first_free(b)) >= 0) {
+            blocks.push_back(b++);
+        }
+        b = first_data;
+        while ((int)blocks.size() < n && (b = fblocks_bitmap.find_first_free(b)) >= 0 && b < goal) {
+            blocks.push_back(b++);
+        }
+    }
+
+    for (std::size_t j = 0; j < blocks.size(); j++) {
+        block_mark(blocks[j], true);  // marca o bloco como ocupado
+    }
+
+    // os blocos usados saem primeiro da reserva de quem chamou
+    if (own) {
+        int used = min(own, (int)blocks.size());
+        reserved_blocks -= used;
+        *reserved -= used;
+    }
+    return blocks.size();
+}
+
+// função auxiliar que promete n blocos livres a um buffer de escrita: eles
+// deixam de contar como livres para as outras alocações até o buffer ser
+// gravado. Retorna false, sem reservar, se não houver n blocos livres
+bool INE5412_FS::block_reserve(int n)
+{
+    std::lock_guard<std::mutex> guard(alloc_lock);
+    if (fblocks_bitmap.count_free() - reserved_blocks < n) {
+        return false;
+    }
+    reserved_blocks += n;
+    return true;
+}
+
+// função auxiliar que devolve n blocos reservados pelo block_reserve
+void INE5412_FS::block_unreserve(int n)
+{
+    if (n) {
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        reserved_blocks -= n;
+    }
+}
+
+// função auxiliar que retorna true se os n bytes de p forem todos zero. Junta
+// 64 bytes por vez com OR, um laço sem desvios que o compilador vetoriza, e
+// para no primeiro trecho com algum bit ligado
+static bool all_zero(const char *p, int n)
+{
+    int i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t w[8];
+        memcpy(w, p + i, sizeof(w));
+        uint64_t acc = 0;
+        for (int k = 0; k < 8; k++) {
+            acc |= w[k];
+        }
+        if (acc) {
+            return false;
+        }
+    }
+    for (; i < n; i++) {
+        if (p[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// escreve no arquivo. A parte da escrita dentro dos blocos que o arquivo já
+// tem vai direto para eles; a parte depois do fim fica no buffer de escrita do
+// inode (alocação atrasada), e os blocos só são escolhidos quando o buffer é
+// gravado: no fs_sync, numa leitura do arquivo ou quando os buffers passam do
+// limite. Assim cada arquivo recebe de uma vez uma sequência contígua, mesmo
+// com vários arquivos sendo escritos intercalados, e o inode e os blocos de
+// ponteiros são gravados uma vez só. Uma escrita depois do fim deixa um buraco
+// entre o fim e offset, e os blocos só de zeros que caem em buracos não são
+// alocados (ver write_data)
 int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
 {
+    Op_Timer timer(op_stats[OP_WRITE]);
+    // verifica se está montado
+    if (!mounted) {
+        cerr << "ERROR: Disk is not mounted" << endl;
+        return 0;
+    }
+
+    int bytes_written = 0;
+    {
+        journal_handle handle(this);
+        std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
+        fs_inode inode;
+        inode_load(inumber, &inode);    // carrega o inode pelo inumber
+
+        // se o inumber for inválido, retorna erro
+        if (!inode.isvalid) {
+            cerr << "ERROR: Invalid inumber" << endl;
+            return 0;
+        }
+
+        // se o offset for negativo, retorna erro
+        if (offset < 0) {
+            cerr << "ERROR: offset is negative" << endl;
+            return 0;
+        }
+
+        // n máximo de blocos de um arquivo; com extents, só o tamanho em bytes limita
+        int max_blocks = extents() ? INT_MAX / Disk::DISK_BLOCK_SIZE : tree_max_blocks();
+        int max_size = max_blocks * Disk::DISK_BLOCK_SIZE;
+
+        // limita a escrita ao tamanho máximo do arquivo
+        if (length > max_size - offset) {
+            length = max_size - offset;
+        }
+        if (length <= 0) {
+            return 0;
+        }
+
+        // arquivo pequeno: fica dentro do inode, ou passa para blocos se deixar de
+        // caber. Sem um bloco livre para os dados do inode, nada muda
+        if (inline_write(inumber, inode, data, length, offset)) {
+            timer.bytes = length;
+            return length;
+        }
+        if (inode.isvalid == INODE_INLINE && !inline_migrate(inumber, inode)) {
+            cerr << "ERROR: disk is full" << endl;
+            return 0;
+        }
+
+        // depois do fim do arquivo (com o buffer), o intervalo até offset vira um
+        // buraco, sem blocos: o buffer é gravado e a escrita vai direto para o
+        // disco. O tamanho só cresce no write_data, até o fim do que foi gravado,
+        // então uma escrita que falha (disco cheio) não deixa o arquivo maior
+        if (offset > buffer_size(inumber, inode.size)) {
+            buffer_flush_locked(inumber, inode);
+            bytes_written = write_data(inumber, inode, data, length, offset);
+        } else {
+            // com um buffer, o tamanho no disco é o início dele, múltiplo do bloco
+            int allocated = (inode.size + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE * Disk::DISK_BLOCK_SIZE;
+            int direct = max(0, min(length, allocated - offset));
+            if (direct > 0) {
+                bytes_written = write_data(inumber, inode, data, direct, offset);
+            }
+
+            // o resto vai para o buffer; se não couber, o buffer é gravado e o resto também
+            if (bytes_written == direct && length > direct) {
+                int rest = length - direct;
+                if (!buffer_write(inumber, inode.size, data + direct, rest, offset + direct)) {
+                    buffer_flush_locked(inumber, inode);
+                    rest = write_data(inumber, inode, data + direct, rest, offset + direct);
+                }
+                bytes_written += rest;
+            }
+        }
+    }
+
+    buffer_evict();
+    timer.bytes = bytes_written;
+    return bytes_written;
+}
+
+// função auxiliar que escreve direto nos blocos do arquivo, alocando os que
+// faltam de uma vez, e grava o inode. Os blocos em que a escrita só tem zeros e
+// que ainda são buracos (ou ficam depois do fim) não são alocados; eles contam
+// como escritos. Os blocos saem primeiro de *reserved, a reserva do buffer de
+// escrita sendo gravado (ver allocate_blocks). Chamada com o inode travado para
+// escrita, dentro de um journal_handle
+int INE5412_FS::write_data(int inumber, fs_inode &inode, const char *data, int length, int offset, int *reserved)
+{
+    int first_block = offset / Disk::DISK_BLOCK_SIZE;  // primeiro bloco lógico da escrita
+    int last_block = (offset + length - 1) / Disk::DISK_BLOCK_SIZE; // último bloco lógico da escrita
+
+    tree_path path;                 // blocos de ponteiros em uso, nos formatos com ponteiros
+    std::vector<fs_extent> ext;     // extents do arquivo, no formato de extents
+    std::vector<int> mapped;        // blocos físicos de [map_from, last_block], no formato de extents
+    int map_from = max(first_block - 1, 0);
+    bool ext_dirty = false;
+
+    // blocos em que a escrita só tem zeros: se forem buracos, continuam buracos
+    std::vector<char> zero(last_block - first_block + 1);
+    bool any_zero = false;
+    for (int b = first_block; b <= last_block; b++) {
+        int from = max(offset, b * Disk::DISK_BLOCK_SIZE);
+        int to = min(offset + length, (b + 1) * Disk::DISK_BLOCK_SIZE);
+        zero[b - first_block] = all_zero(data + (from - offset), to - from);
+        any_zero |= zero[b - first_block];
+    }
+
+    // conta quantos blocos precisam ser alocados
+    int missing = 0;
+    int goal = 0;   // bloco físico preferido para a alocação
+    if (extents()) {
+        // carrega os extents e resolve o intervalo uma única vez
+        extents_load(inode, ext);
+        resolve_blocks(inode, map_from, last_block - map_from + 1, mapped);
+        for (int b = first_block; b <= last_block; b++) {
+            missing += !mapped[b - map_from] && !zero[b - first_block];
+        }
+    } else {
+        // dados e blocos de ponteiros que faltam; com blocos de zeros, resolve o
+        // intervalo todo para saber quais deles são buracos
+        missing = tree_missing(inode, first_block, last_block, zero);
+        if (any_zero) {
+            resolve_blocks(inode, map_from, last_block - map_from + 1, mapped);
+        } else if (first_block > 0) {
+            resolve_blocks(inode, first_block - 1, 1, mapped);
+        }
+    }
+
+    // tenta continuar logo depois do último bloco do arquivo
+    if (first_block > 0 && mapped[0]) {
+        goal = mapped[0] + 1;
+    }
+
+    std::vector<int> new_blocks;
+    int nalloc = allocate_blocks(missing, goal, new_blocks, reserved);
+    int next_new = 0;   // próximo bloco reservado a ser usado
+
+    int bytes_written = 0;
+    std::vector<Disk::block_io> full_blocks;    // blocos inteiros, escritos juntos no fim
+
+    for (int b = first_block; b <= last_block; b++) {
+        int block_num;
+        bool fresh = false;    // bloco recém alocado, conteúdo anterior é zero
+        int curr_offset = offset + bytes_written;   // offset atual
+        int block_offset = curr_offset % Disk::DISK_BLOCK_SIZE; // offset dentro do bloco
+        int bytes_to_write = min(length - bytes_written, Disk::DISK_BLOCK_SIZE - block_offset);
+
+        // zeros num buraco: nada a gravar, o fs_read já devolve zeros
+        if (zero[b - first_block] && !mapped[b - map_from]) {
+            bytes_written += bytes_to_write;
+            continue;
+        }
+
+        if (extents()) {
+            block_num = mapped[b - map_from];
+            if (!block_num) {
+                // disco cheio (ou sem espaço para mais extents), escreve só o que coube
+                if (next_new == nalloc || !extent_add(inode, ext, b, new_blocks[next_new], reserved)) {
+                    break;
+                }
+                block_num = new_blocks[next_new++];
+                fresh = true;
+                ext_dirty = true;
+            }
+        } else {
+            // os blocos de ponteiros são alocados antes dos blocos de dados que dependem deles
+            block_num = tree_block(path, inode, b, new_blocks, next_new, fresh);
+            if (!block_num) {
+                break;  // disco cheio, escreve só o que coube
+            }
+        }
+
+        if (bytes_to_write == Disk::DISK_BLOCK_SIZE) {
+            // bloco inteiro, vai direto do buffer do chamador para o disco
+            Disk::block_io io;
+            io.blocknum = block_num;
+            io.data = (char *)data + bytes_written;
+            full_blocks.push_back(io);
+        } else {
+            // bloco parcial, precisa ler o conteúdo antigo (ou zerar se for novo)
+            union fs_block block;
+            if (fresh) {
+                memset(block.data, 0, Disk::DISK_BLOCK_SIZE);
+            } else {
+                cache.read(block_num, block.data);
+            }
+            memcpy(block.data + block_offset, data + bytes_written, bytes_to_write);
+            cache.write(block_num, block.data);
+        }
+
+        bytes_written += bytes_to_write;
+    }
+
+    cache.write_blocks(full_blocks);    // escrita vetorizada, blocos consecutivos numa única chamada
+    tree_flush(path, 0);                // cada bloco de ponteiros alterado é escrito uma vez
+
+    // devolve os blocos reservados que não foram usados
+    if (next_new < nalloc) {
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        for (int j = next_new; j < nalloc; j++) {
+            block_mark(new_blocks[j], false);
+        }
+    }
+
+    if (ext_dirty) {
+        extents_store(inode, ext);
+    }
+
+    // atualiza o tamanho do inode e salva uma vez; sem nenhum byte escrito (disco
+    // cheio), uma escrita depois do fim não aumenta o arquivo
+    if (bytes_written > 0 && offset + bytes_written > inode.size) {
+        inode.size = offset + bytes_written;
+    }
+    inode_save(inumber, &inode);
+    bitmap_save();
+
+    return bytes_written;   // retorna a quantidade de bytes escritos
+}
+
+// função auxiliar que retorna o tamanho do arquivo contando o buffer de escrita
+int INE5412_FS::buffer_size(int inumber, int size)
+{
+    if (!write_buffered) {
+        return size;
+    }
+    std::lock_guard<std::mutex> guard(buffer_lock);
+    std::unordered_map<int, write_buffer>::iterator it = write_buffers.find(inumber);
+    if (it == write_buffers.end()) {
+        return size;
+    }
+    return it->second.start + it->second.data.size();
+}
+
+// função auxiliar que retorna quantos blocos gravar bytes de um buffer pode
+// alocar, no pior caso: os de dados, mais os de ponteiros (ou o overflow dos
+// extents) que eles podem precisar
+static int buffer_blocks(long bytes)
+{
+    long blocks = (bytes + Disk::DISK_BLOCK_SIZE - 1) / Disk::DISK_BLOCK_SIZE;
+    return blocks + blocks / INE5412_FS::POINTERS_PER_BLOCK + INE5412_FS::INDIRECT_LEVELS + 2;
+}
+
+// função auxiliar que guarda no buffer do inode uma escrita depois do fim dos
+// blocos do arquivo (size, o tamanho no disco). Retorna false, sem guardar, se
+// não houver buffer (limite 0), se a escrita for grande (uma escrita de um
+// quarto do limite já recebe sozinha uma sequência contígua, e copiá-la para o
+// buffer só custaria tempo) ou se não for possível reservar os blocos para
+// gravar o buffer inteiro. Com a reserva, a gravação do buffer sempre tem
+// blocos, mesmo que outros arquivos encham o disco antes dela, e os bytes
+// aceitos aqui nunca se perdem. Chamada com o inode travado para escrita
+bool INE5412_FS::buffer_write(int inumber, int size, const char *data, int length, int offset)
+{
+    if (length >= write_buffer_size / 4) {
+        return false;
+    }
+
+    // o buffer do inode só muda com o inode travado, então não muda entre os dois locks
+    int start = size;
+    long buffered = 0;
+    int reserved = 0;
+    {
+        std::lock_guard<std::mutex> guard(buffer_lock);
+        std::unordered_map<int, write_buffer>::iterator it = write_buffers.find(inumber);
+        if (it != write_buffers.end()) {
+            start = it->second.start;
+            buffered = it->second.data.size();
+            reserved = it->second.reserved;
+        }
+    }
+    long end = (long)offset + length - start;
+    int need = buffer_blocks(max(end, buffered));
+    if (need > reserved && !block_reserve(need - reserved)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(buffer_lock);
+    write_buffer &wb = write_buffers[inumber];
+    wb.start = start;
+    wb.reserved = max(need, reserved);
+    if (end > buffered) {
+        wb.data.resize(end);
+        write_buffered += end - buffered;
+    }
+    memcpy(&wb.data[offset - start], data, length);
+    return true;
+}
+
+// função auxiliar que grava o buffer do inode, se houver: os blocos são
+// alocados todos juntos pelo write_data. Chamada com o inode travado para
+// escrita, dentro de um journal_handle
+void INE5412_FS::buffer_flush_locked(int inumber, fs_inode &inode)
+{
+    write_buffer wb;
+    {
+        std::lock_guard<std::mutex> guard(buffer_lock);
+        std::unordered_map<int, write_buffer>::iterator it = write_buffers.find(inumber);
+        if (it == write_buffers.end()) {
+            return;
+        }
+        wb.start = it->second.start;
+        wb.reserved = it->second.reserved;
+        wb.data.swap(it->second.data);
+        write_buffers.erase(it);
+        write_buffered -= wb.data.size();
+    }
+
+    // os blocos saem da reserva do buffer, e o que sobrar dela volta a ficar livre
+    int n = write_data(inumber, inode, wb.data.data(), wb.data.size(), wb.start, &wb.reserved);
+    block_unreserve(wb.reserved);
+    if (n < (int)wb.data.size()) {
+        cerr << "ERROR: disk is full, " << wb.data.size() - n << " buffered bytes of inode " << inumber << " were lost" << endl;
+    }
+}
+
+// função auxiliar que grava o buffer do inode, se houver
+void INE5412_FS::buffer_flush(int inumber)
+{
+    {
+        std::lock_guard<std::mutex> guard(buffer_lock);
+        if (!write_buffers.count(inumber)) {
+            return;
+        }
+    }
+
+    journal_handle handle(this);
+    std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inumber));
     fs_inode inode;
-	return 0;
+    inode_load(inumber, &inode);
+    buffer_flush_locked(inumber, inode);
+}
+
+// função auxiliar que grava todos os buffers de escrita
+void INE5412_FS::buffer_flush_all()
+{
+    std::vector<int> inumbers;
+    {
+        std::lock_guard<std::mutex> guard(buffer_lock);
+        for (std::unordered_map<int, write_buffer>::iterator it = write_buffers.begin(); it != write_buffers.end(); it++) {
+            inumbers.push_back(it->first);
+        }
+    }
+    std::sort(inumbers.begin(), inumbers.end());
+    for (std::size_t i = 0; i < inumbers.size(); i++) {
+        buffer_flush(inumbers[i]);
+    }
+}
+
+// função auxiliar que, enquanto os buffers passarem do limite, grava o maior.
+// Chamada sem nenhum lock
+void INE5412_FS::buffer_evict()
+{
+    while (write_buffered > write_buffer_size) {
+        int victim = 0;
+        std::size_t most = 0;
+        {
+            std::lock_guard<std::mutex> guard(buffer_lock);
+            for (std::unordered_map<int, write_buffer>::iterator it = write_buffers.begin(); it != write_buffers.end(); it++) {
+                if (it->second.data.size() > most) {
+                    most = it->second.data.size();
+                    victim = it->first;
+                }
+            }
+        }
+        if (!victim) {
+            break;
+        }
+        buffer_flush(victim);
+    }
+}
+
+// função auxiliar que descarta o buffer do inode, no fs_delete
+void INE5412_FS::buffer_drop(int inumber)
+{
+    int reserved = 0;
+    {
+        std::lock_guard<std::mutex> guard(buffer_lock);
+        std::unordered_map<int, write_buffer>::iterator it = write_buffers.find(inumber);
+        if (it != write_buffers.end()) {
+            reserved = it->second.reserved;
+            write_buffered -= it->second.data.size();
+            write_buffers.erase(it);
+        }
+    }
+    block_unreserve(reserved);
+}
+
+// função auxiliar que escreve num arquivo pequeno, com FORMAT_INLINE: um
+// arquivo vazio e sem blocos (nem buffer) passa a guardar os dados no inode se
+// a escrita couber lá, e um arquivo que já está no inode continua nele.
+// Retorna true se a escrita foi feita no inode; se ela não couber num arquivo
+// que está no inode, o chamador tira os dados de lá com o inline_migrate.
+// Chamada com o inode travado para escrita, dentro de um journal_handle
+bool INE5412_FS::inline_write(int inumber, fs_inode &inode, const char *data, int length, int offset)
+{
+    if (inode.isvalid != INODE_INLINE) {
+        // só um arquivo vazio e sem blocos pode passar para o inode
+        if (!superblock.inlinesize || inode.size || offset + length > superblock.inlinesize
+            || buffer_size(inumber, inode.size)) {
+            return false;
+        }
+        for (int i = 0; i <= POINTERS_PER_INODE; i++) {
+            if (inode.pointers[i]) {
+                return false;
+            }
+        }
+        inode.isvalid = INODE_INLINE;
+    } else if (offset + length > superblock.inlinesize) {
+        return false;
+    }
+
+    // os bytes depois do tamanho, e os de um buraco até offset, são sempre zero
+    memcpy(inode.data + offset, data, length);
+    inode.size = max(inode.size, offset + length);
+    inode_save(inumber, &inode);
+    return true;
+}
+
+// função auxiliar que tira os dados de dentro do inode e os grava num bloco,
+// deixando um arquivo comum com o mesmo tamanho. Retorna false se não houver
+// bloco livre: o inode volta a ser como era, com os dados dentro dele. Chamada
+// com o inode travado para escrita, dentro de um journal_handle
+bool INE5412_FS::inline_migrate(int inumber, fs_inode &inode)
+{
+    fs_inode saved = inode;
+    int size = inode.size;
+
+    memset(inode.data, 0, INLINE_SIZE);
+    inode.isvalid = 1;
+    inode.size = 0;
+
+    // os dados cabem num bloco só, que o write_data grava inteiro ou não grava
+    int n = size ? write_data(inumber, inode, saved.data, size, 0) : 0;
+    if (n < size) {
+        inode = saved;
+        inode_save(inumber, &inode);
+        return false;
+    }
+    inode.size = size;
+    inode_save(inumber, &inode);
+    return true;
+}
+
+// função auxiliar que carrega em ext todos os extents do inode
+void INE5412_FS::extents_load(fs_inode &inode, std::vector<fs_extent> &ext)
+{
+    int n = max(0, min(inode.nextents, INODE_EXTENTS + EXTENTS_PER_BLOCK));
+
+    ext.assign(inode.extents, inode.extents + min(n, (int)INODE_EXTENTS));
+    if (n > INODE_EXTENTS) {
+        std::lock_guard<std::mutex> guard(map_lock);
+        fs_extent *overflow = map_block(inode.overflow)->extents;
+        ext.insert(ext.end(), overflow, overflow + (n - INODE_EXTENTS));
+    }
+}
+
+// função auxiliar que grava a lista de extents no inode e, os que não couberem, no bloco overflow
+void INE5412_FS::extents_store(fs_inode &inode, std::vector<fs_extent> &ext)
+{
+    inode.nextents = ext.size();
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        if (i < (int)ext.size()) {
+            inode.extents[i] = ext[i];
+        } else {
+            inode.extents[i].start = inode.extents[i].length = 0;
+        }
+    }
+
+    if ((int)ext.size() > INODE_EXTENTS) {
+        union fs_block block;
+        memset(block.data, 0, Disk::DISK_BLOCK_SIZE);
+        std::copy(ext.begin() + INODE_EXTENTS, ext.end(), block.extents);
+        meta_write(inode.overflow, block.data);
+        map_update(inode.overflow, &block);
+    }
+}
+
+// função auxiliar que mapeia o bloco lógico block_i no bloco físico blocknum (0 =
+// buraco) numa lista de extents: divide o extent que tinha o bloco, ou estende a
+// lista se o bloco estiver depois do fim, e junta o resultado com os vizinhos contíguos
+void INE5412_FS::extent_set(std::vector<fs_extent> &ext, int block_i, int blocknum)
+{
+    int logical = 0;    // primeiro bloco lógico do extent e
+    std::size_t e = 0;
+
+    while (e < ext.size() && block_i >= logical + ext[e].length) {
+        logical += ext[e].length;
+        e++;
+    }
+
+    fs_extent single = { blocknum, 1 };
+    if (e == ext.size()) {
+        // depois do fim: um buraco até o bloco, se preciso, e o bloco
+        if (block_i > logical) {
+            fs_extent hole = { 0, block_i - logical };
+            ext.push_back(hole);
+            e++;
+        }
+        ext.push_back(single);
+    } else {
+        fs_extent old = ext[e];
+        int pos = block_i - logical;
+        fs_extent parts[3];
+        int nparts = 0;
+
+        if (pos > 0) {
+            parts[nparts].start = old.start;
+            parts[nparts++].length = pos;
+        }
+        parts[nparts++] = single;
+        if (pos + 1 < old.length) {
+            parts[nparts].start = old.start ? old.start + pos + 1 : 0;
+            parts[nparts++].length = old.length - pos - 1;
+        }
+        ext.erase(ext.begin() + e);
+        ext.insert(ext.begin() + e, parts, parts + nparts);
+        if (pos > 0) {
+            e++;
+        }
+    }
+
+    // junta o extent do bloco com o seguinte e com o anterior, se forem contíguos
+    for (int k = 0; k < 2; k++) {
+        std::size_t a = k == 0 ? e : e - 1;
+        if ((k == 1 && e == 0) || a + 1 >= ext.size()) {
+            continue;
+        }
+        bool contiguous = ext[a].start ? ext[a + 1].start == ext[a].start + ext[a].length : !ext[a + 1].start;
+        if (contiguous) {
+            ext[a].length += ext[a + 1].length;
+            ext.erase(ext.begin() + a + 1);
+        }
+    }
+}
+
+// função auxiliar que mapeia o bloco lógico block_i em blocknum nos extents do
+// inode, reservando o bloco overflow (de *reserved, se houver; ver allocate_blocks)
+// quando os extents deixam de caber no inode. Retorna false, sem alterar nada,
+// se não couberem nem com o overflow
+bool INE5412_FS::extent_add(fs_inode &inode, std::vector<fs_extent> &ext, int block_i, int blocknum, int *reserved)
+{
+    int room = inode.overflow ? INODE_EXTENTS + EXTENTS_PER_BLOCK : INODE_EXTENTS;
+    std::vector<fs_extent> saved;
+
+    // o extent_set cria no máximo dois extents
+    if ((int)ext.size() + 2 > room) {
+        saved = ext;
+    }
+    extent_set(ext, block_i, blocknum);
+    if ((int)ext.size() <= room) {
+        return true;
+    }
+
+    std::vector<int> overflow;
+    if (!inode.overflow && (int)ext.size() <= INODE_EXTENTS + EXTENTS_PER_BLOCK && allocate_blocks(1, blocknum + 1, overflow, reserved)) {
+        inode.overflow = overflow[0];
+        return true;
+    }
+    ext = saved;
+    return false;
 }
 
 // função auxiliar que retorna o indice do bloco de dados
 int INE5412_FS::get_dblocknum(fs_inode &inode, int block_i) {
     int block_num;  // indice do bloco de dados
 
-    // se o indice do bloco for menor que o n de ponteiros diretos por inode
-    if (block_i < POINTERS_PER_INODE) {
-        block_num = inode.direct[block_i];  // armazena o indice do bloco de dados conforme o indice do bloco
-        return block_num;
-    } 
-
-    // se o bloco indireto for 0, retorna erro
-    if (inode.indirect == 0) {
-        cerr << "ERROR: Indirect block is not allocated" << endl;
-        return 0;
+    // no formato de extents, resolve pelos extents
+    if (extents()) {
+        std::vector<int> blocks;
+        resolve_blocks(inode, block_i, 1, blocks);
+        return blocks[0];
     }
 
-    union fs_block ind_block;
+    int index[INDIRECT_LEVELS];
+    int level = tree_locate(block_i, index);   // nível de indireção do bloco
 
-    disk->read(inode.indirect, ind_block.data); // le o bloco indireto
+    // se o indice do bloco passar do tamanho máximo do arquivo, retorna erro
+    if (level < 0) {
+        cerr << "ERROR: Block index is out of range" << endl;
+        return 0;
+    }
 
-    int indblock_i = block_i - POINTERS_PER_INODE;  // calcula o indice do bloco de dados indireto
+    // se o bloco for direto, armazena o indice do bloco de dados conforme o indice do bloco
+    if (level == 0) {
+        block_num = inode.pointers[block_i];
+        return block_num;
+    }
 
-    // se o indblock_i for maior ou igual ao n de ponteiros por bloco, retorna erro
-    if (indblock_i >= POINTERS_PER_BLOCK) {
-        cerr << "ERROR: Block index is out of range" << endl;
+    // se o bloco indireto do nível for 0, retorna erro
+    block_num = inode.pointers[tree_direct() + level - 1];
+    if (block_num == 0) {
+        cerr << "ERROR: Indirect block is not allocated" << endl;
         return 0;
     }
 
-    block_num = ind_block.pointers[indblock_i]; // armazena o indice do bloco de dados
+    // desce pelos blocos de ponteiros até o bloco de dados
+    std::lock_guard<std::mutex> guard(map_lock);
+    for (int k = 0; block_num && k < level; k++) {
+        block_num = map_block(block_num)->pointers[index[k]];
+    }
     return block_num;
-} 
\ No newline at end of file
+}
@@ -2,8 +2,21 @@
 #define FS_H
 
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "stats.h"
 #include <vector> 
 #include <cstring>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+// As operações sobre arquivos (create, delete, read, write, getsize, sync) podem
+// ser chamadas por várias threads ao mesmo tempo. format, mount e unmount não:
+// devem ser chamadas sem nenhuma outra operação em andamento
 class INE5412_FS
 {
 public:
@@ -11,6 +24,33 @@ public:
     static const unsigned short int INODES_PER_BLOCK = 128;
     static const unsigned short int POINTERS_PER_INODE = 5;
     static const unsigned short int POINTERS_PER_BLOCK = 1024;
+    static const int INODE_EXTENTS = 2;         // extents guardados no próprio inode
+    static const int EXTENTS_PER_BLOCK = 512;   // extents no bloco overflow
+    static const int FS_VERSION_POINTERS = 0;   // inodes com ponteiros diretos e um bloco indireto
+    static const int FS_VERSION_EXTENTS = 1;    // inodes com extents
+    static const int FS_VERSION_INDIRECT = 2;   // inodes com blocos indireto, duplo e triplo indireto
+    static const int INDIRECT_DIRECT = 3;       // ponteiros diretos no FS_VERSION_INDIRECT
+    static const int INDIRECT_LEVELS = 3;       // níveis de indireção no FS_VERSION_INDIRECT
+    static const int FORMAT_FAST = 1;       // flags do fs_format
+    static const int FORMAT_EXTENTS = 2;
+    static const int FORMAT_INDIRECT = 4;
+    static const int FORMAT_INLINE = 8;
+    static const int INODE_INLINE = 2;      // isvalid de um inode com os dados guardados nele mesmo
+    static const int INLINE_SIZE = sizeof(int) * (POINTERS_PER_INODE + 1);     // bytes de dados que cabem no inode
+    static const int BITS_PER_BLOCK = Disk::DISK_BLOCK_SIZE * 8;
+    static const int INODE_FLUSH_INTERVAL = 1024;
+    static const int MAP_CACHE_SIZE = 16;
+    static const int READAHEAD_STREAMS = 8;    // inodes com readahead acompanhados ao mesmo tempo
+    static const int READAHEAD_MIN = 4;        // janela inicial de readahead, em blocos
+    static const int FORMAT_CHUNK = 256;    // blocos zerados por escrita no fs_format
+    static const int SCAN_THREADS = 8;      // threads da varredura de inodes no fs_mount
+    static const int SCAN_MIN_BLOCKS = 16;  // blocos de inode por thread, no mínimo
+    static const int INODE_LOCKS = 256;     // locks de leitura/escrita dos inodes, escolhidos pelo inumber
+    static const int WRITE_BUFFER_SIZE = 4 << 20;   // bytes nos buffers de escrita, somando todos os arquivos
+    static const unsigned int JOURNAL_MAGIC = 0x6a726e6c;
+    static const unsigned int JOURNAL_COMMIT_MAGIC = 0x6a636d74;
+    static const int JOURNAL_BLOCKS = 1024;     // tamanho do journal, em blocos, se couber a maior transação
+    static const int JOURNAL_ENTRIES = Disk::DISK_BLOCK_SIZE / sizeof(int) - 5;    // blocos listados num descritor
 
     class fs_superblock {
         public:
@@ -18,14 +58,71 @@ public:
             int nblocks;
             int ninodeblocks;
             int ninodes;
+            int nbitmapblocks;      // blocos do bitmap de blocos livres, depois da tabela de inodes (0 em imagens antigas)
+            int ninodemapblocks;    // blocos do mapa de inodes livres, depois do bitmap de blocos
+            int clean;              // 1 se o disco foi desmontado corretamente
+            int inodeinit;          // primeiro bloco de inode ainda não inicializado (0 = tabela toda inicializada)
+            int version;            // formato dos inodes (FS_VERSION_POINTERS em imagens antigas)
+            int njournalblocks;     // blocos do journal, depois dos mapas (0 = sem journal)
+            int inlinesize;         // arquivos até esse tamanho ficam dentro do inode (0 = sempre em blocos)
     }; 
 
+    // trecho de um arquivo no formato de extents: length blocos lógicos, logo
+    // depois dos do extent anterior, guardados a partir do bloco físico start (0 = buraco)
+    class fs_extent {
+        public:
+            int start;
+            int length;
+    };
+
     class fs_inode {
         public:
             int isvalid;
             int size;
-            int direct[POINTERS_PER_INODE];
-            int indirect;
+            union {
+                // FS_VERSION_POINTERS
+                struct {
+                    int direct[POINTERS_PER_INODE];
+                    int indirect;
+                };
+                // formatos com árvore de ponteiros: os diretos seguidos das raízes de cada nível
+                // de indireção. No FS_VERSION_INDIRECT são 3 diretos, o indireto, o duplo e o triplo
+                int pointers[POINTERS_PER_INODE + 1];
+                // FS_VERSION_EXTENTS: os extents que não cabem no inode ficam no bloco overflow
+                struct {
+                    fs_extent extents[INODE_EXTENTS];
+                    int nextents;
+                    int overflow;
+                };
+                // inodes INODE_INLINE, em qualquer formato: os próprios dados do arquivo
+                char data[INLINE_SIZE];
+            };
+    };
+
+    // descritor de uma transação do journal, seguido das imagens dos count blocos
+    // listados em blocks e de um bloco de commit, no mesmo formato, com o magic
+    // JOURNAL_COMMIT_MAGIC e a seq e o checksum do descritor. Depois dos count
+    // blocos, blocks tem os nrevoke blocos liberados na transação, cujas imagens em
+    // transações anteriores não podem ser reaplicadas. O primeiro bloco do journal
+    // é um cabeçalho no mesmo formato, com a seq da primeira transação a reaplicar
+    class fs_journal {
+        public:
+            unsigned int magic;
+            int seq;
+            int count;
+            int nrevoke;
+            unsigned int checksum;  // do descritor (com checksum 0) e das imagens
+            int blocks[JOURNAL_ENTRIES];
+    };
+
+    // operações com contadores e histograma de latência (ver fs_stats)
+    enum Op { OP_MOUNT, OP_CREATE, OP_DELETE, OP_GETSIZE, OP_READ, OP_WRITE, OP_PUNCH, OP_SYNC, OPS };
+
+    // trecho de um arquivo devolvido pelo fs_read_view, só de leitura
+    class fs_view {
+        public:
+            const char *data;
+            int length;
     };
 
     union fs_block {
@@ -33,34 +130,225 @@ public:
             fs_superblock super;
             fs_inode inode[INODES_PER_BLOCK];
             int pointers[POINTERS_PER_BLOCK];
+            fs_extent extents[EXTENTS_PER_BLOCK];
+            fs_journal journal;
             char data[Disk::DISK_BLOCK_SIZE];
     };
 
 public:
 
-    INE5412_FS(Disk *d) {
+    INE5412_FS(Disk *d, int cache_blocks = Block_Cache::DEFAULT_CAPACITY, Block_Cache::Policy policy = Block_Cache::LRU)
+        : cache(d, cache_blocks, policy) {
         disk = d;
     } 
 
     void fs_debug();
-    int  fs_format();
+    int  fs_format(int flags = 0);
     int  fs_mount();
+    void fs_unmount();
+    void fs_sync();
+    void fs_stats(ostream &out, bool json);
+    void fs_stats_reset();
+    int  fs_check();
 
     int  fs_create();
+    int  fs_create_many(int n, std::vector<int> &inumbers);
     int  fs_delete(int inumber);
     int  fs_getsize(int inumber);
 
     int  fs_read(int inumber, char *data, int length, int offset);
     int  fs_write(int inumber, const char *data, int length, int offset);
+    int  fs_read_view(int inumber, std::vector<fs_view> &views, int length, int offset);
+    void fs_release_view(std::vector<fs_view> &views);
+    int  fs_punch(int inumber, int offset, int length);
     void inode_load( int inumber, class fs_inode *inode );
     void inode_save( int inumber, class fs_inode *inode );
     int get_dblocknum(fs_inode &inode, int block_i); 
+    void resolve_blocks(fs_inode &inode, int first, int count, std::vector<int> &blocks);
+    void readahead(int inumber, fs_inode &inode, int offset, int length, std::vector<int> &ahead);
+    int allocate_blocks(int n, int goal, std::vector<int> &blocks, int *reserved = 0);
+    void set_inode_flush_interval(int n) { inode_flush_interval = n; }
+    void set_discard(bool on) { discard_freed = on; }
+    void set_print_bitmap(bool on) { print_mount_bitmap = on; }
+    void set_write_buffer(int bytes) { write_buffer_size = bytes; }
+
+private:
+    class tree_path;
+    class journal_handle;
+
+    void zero_blocks(int first, int count);
+    void scan_inodes();
+    void scan_range(int first, int last, Bitmap &blocks, Bitmap &inodes);
+    fs_block *inode_block(int block_number);
+    void inode_touch(int block_number);
+    void inode_flush();
+    int  create_batch(int n, std::vector<int> &inumbers);
+    void inode_init(int last);
+    bool inode_initialized(int block_number) { return !superblock.inodeinit || block_number < superblock.inodeinit; }
+    void discard_blocks(std::vector<int> &blocks);
+    void release_blocks(std::vector<int> &freed);
+    void punch_blocks(int inumber, fs_inode &inode, int first, int last, std::vector<int> &freed);
+    int  write_data(int inumber, fs_inode &inode, const char *data, int length, int offset, int *reserved = 0);
+    bool block_reserve(int n);
+    void block_unreserve(int n);
+    int  buffer_size(int inumber, int size);
+    bool buffer_write(int inumber, int size, const char *data, int length, int offset);
+    void buffer_flush_locked(int inumber, fs_inode &inode);
+    void buffer_flush(int inumber);
+    void buffer_flush_all();
+    void buffer_evict();
+    void buffer_drop(int inumber);
+    bool inline_write(int inumber, fs_inode &inode, const char *data, int length, int offset);
+    bool inline_migrate(int inumber, fs_inode &inode);
+    void file_blocks(fs_inode &inode, std::vector<int> &blocks);
+    void extents_load(fs_inode &inode, std::vector<fs_extent> &ext);
+    void extents_store(fs_inode &inode, std::vector<fs_extent> &ext);
+    void extent_set(std::vector<fs_extent> &ext, int block_i, int blocknum);
+    int  tree_direct() { return superblock.version == FS_VERSION_INDIRECT ? INDIRECT_DIRECT : POINTERS_PER_INODE; }
+    int  tree_levels() { return superblock.version == FS_VERSION_INDIRECT ? INDIRECT_LEVELS : 1; }
+    int  tree_locate(int block_i, int *index);
+    int  tree_max_blocks();
+    int  tree_missing(fs_inode &inode, int first, int last, const std::vector<char> &zero);
+    int  tree_block(tree_path &path, fs_inode &inode, int block_i, std::vector<int> &pool, int &next, bool &fresh);
+    void tree_flush(tree_path &path, int from);
+    void tree_collect(int blocknum, int height, std::vector<int> &data, std::vector<int> *nodes);
+    bool tree_punch(int blocknum, int height, long first, long last, std::vector<int> &freed);
+    bool extent_add(fs_inode &inode, std::vector<fs_extent> &ext, int block_i, int blocknum, int *reserved = 0);
+    bool extents() { return superblock.version == FS_VERSION_EXTENTS; }
+    fs_block *map_block(int blocknum);
+    void map_update(int blocknum, const fs_block *block);
+    void bitmap_load();
+    void bitmap_save();
+    void block_mark(int blocknum, bool used);
+    void inode_mark(int inumber, bool used);
+    void set_clean(bool clean);
+    std::shared_mutex &inode_lock(int inumber) { return inode_locks[(unsigned)inumber % INODE_LOCKS]; }
+    int  journal_first() { return 1 + superblock.ninodeblocks + superblock.nbitmapblocks + superblock.ninodemapblocks; }
+    int  data_start() { return journal_first() + superblock.njournalblocks; }
+    bool journaling() { return superblock.njournalblocks > 0; }
+    int  journal_capacity();
+    static int journal_op_blocks(int nblocks, int nbitmapblocks);
+    int  journal_pending();
+    void journal_count(int blocknum);
+    void block_types();
+    void meta_read(int blocknum, char *data);
+    void meta_write(int blocknum, const char *data);
+    void journal_start();
+    void journal_stop();
+    void journal_commit();
+    void journal_write(const int *blocks, int count, std::vector<int> &revoked);
+    void journal_checkpoint();
+    void journal_replay();
+
+private:
+    class map_entry {
+        public:
+            int blocknum = 0;       // bloco de ponteiros guardado (0 = vazio)
+            unsigned long used = 0; // último acesso, para substituir o mais antigo
+            fs_block block;
+    };
+
+    // caminho na árvore de ponteiros de um inode durante o fs_write: os blocos de
+    // ponteiros de cada profundidade, alterados na memória e gravados ao sair deles
+    class tree_node {
+        public:
+            int blocknum = 0;
+            bool dirty = false;
+            fs_block block;
+    };
+    class tree_path {
+        public:
+            int level = -1;     // nível de indireção do caminho carregado (-1 = nenhum)
+            int index[INDIRECT_LEVELS];     // índice seguido em cada profundidade
+            tree_node node[INDIRECT_LEVELS];
+    };
+
+    // operação que altera metadados (create, delete, write). Enquanto existe, o
+    // journal_commit espera, assim uma transação nunca tem uma operação pela metade
+    class journal_handle {
+        public:
+            journal_handle(INE5412_FS *f) : fs(f), active(f->journaling()) {
+                if (active) {
+                    fs->journal_start();
+                }
+            }
+            ~journal_handle() {
+                if (active) {
+                    fs->commit_lock.unlock_shared();
+                    fs->journal_stop();
+                }
+            }
+        private:
+            INE5412_FS *fs;
+            bool active;
+    };
+
+    // escritas depois do fim de um arquivo, ainda sem blocos: os bytes a partir
+    // de start, o tamanho do arquivo no disco, sempre múltiplo do bloco
+    class write_buffer {
+        public:
+            int start = 0;
+            int reserved = 0;   // blocos reservados para gravar o buffer, no pior caso
+            std::vector<char> data;
+    };
+
+    class ra_stream {
+        public:
+            int inumber = 0;
+            int next_offset = 0;    // offset esperado da próxima leitura sequencial
+            int window = 0;         // blocos carregados adiante (0 = desligado)
+            int ahead_end = 0;      // primeiro bloco lógico ainda não carregado
+            unsigned long used = 0;
+    };
 
 private:
     Disk *disk;
-    std::vector<int> fblocks_bitmap;
-    bool mounted = false;
+    Block_Cache cache;
+    Bitmap fblocks_bitmap;
+    Bitmap finodes_bitmap;
+    int inode_cursor;  // nenhum inode livre antes do cursor
+    std::vector<char> bitmap_dirty;    // blocos da região de bitmaps alterados desde o último bitmap_save
+    std::vector<fs_block> inode_table; // blocos de inode residentes na memória
+    std::vector<char> inode_loaded;
+    std::vector<char> inode_dirty;
+    int inode_changes;  // alterações desde o último inode_flush
+    int inode_flush_interval = INODE_FLUSH_INTERVAL;    // 0 = só grava no sync/unmount
+    bool discard_freed = true;  // abre buracos na imagem no lugar dos blocos liberados pelo fs_delete
+    bool print_mount_bitmap = false;    // imprime o bitmap de blocos livres a cada fs_mount
+    std::vector<map_entry> map_cache;   // blocos indiretos dos últimos arquivos lidos/escritos
+    unsigned long map_tick;
+    std::atomic<long> map_hits{0};
+    std::atomic<long> map_misses{0};
+    std::vector<ra_stream> ra_streams;  // estado de readahead por inode
+    unsigned long ra_tick;
+    std::unordered_map<int, write_buffer> write_buffers;   // buffers de escrita por inumber
+    std::atomic<long> write_buffered{0};    // bytes em todos os buffers
+    int write_buffer_size = WRITE_BUFFER_SIZE;  // limite de write_buffered (0 = escreve direto)
+    int reserved_blocks = 0;    // blocos livres prometidos aos buffers de escrita
+    int ra_max;     // janela máxima de readahead, metade do cache
+    std::atomic<bool> mounted{false};
     fs_superblock superblock;
+    std::map<int, fs_block> journal_txn;    // blocos de metadados da transação em andamento
+    std::vector<int> journal_freed;     // blocos liberados, devolvidos ao bitmap no próximo commit
+    std::unordered_set<int> journal_logged;    // blocos de dados (de ponteiros ou overflow) no journal desde o checkpoint
+    int journal_head;   // próxima posição livre do journal
+    int journal_seq;    // seq da próxima transação
+    int journal_ops;    // operações desde o último commit
+    int journal_op_max;     // blocos reservados por operação (ver journal_op_blocks)
+    int journal_credits;    // blocos reservados pelas operações em andamento
+    int journal_used;   // blocos que as operações já podem ter posto na transação em andamento
+    Op_Stats op_stats[OPS];
+
+    // locks, sempre tomados nesta ordem: commit; inode; tabela, alocação, readahead ou buffers; mapas; journal; superbloco
+    std::shared_mutex commit_lock;  // compartilhado pelas operações, exclusivo no journal_commit
+    std::shared_mutex inode_locks[INODE_LOCKS];  // leitores em paralelo, um escritor por arquivo
+    std::mutex table_lock;  // inode_table, inode_loaded, inode_dirty, inode_changes
+    std::mutex alloc_lock;  // bitmaps, bitmap_dirty, inode_cursor e reserved_blocks
+    std::mutex map_lock;    // map_cache
+    std::mutex ra_lock;     // ra_streams
+    std::mutex buffer_lock; // write_buffers e write_buffered
+    std::mutex journal_lock;    // journal_txn, journal_freed, journal_logged, journal_used, journal_credits e a posição do journal
+    std::mutex super_lock;  // bloco 0, alterado pelo set_clean e pelo inode_init
 };
 
 #endif
\ No newline at end of file
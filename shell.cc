@@ -1,188 +1,452 @@
 #include "fs.h"
 #include "disk.h"
 
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 class File_Ops
 {
 public:
-    static int do_copyin(const char *filename, int inumber, INE5412_FS *fs);
+    static const int COPY_BUFFER_SIZE = 1 << 20;    // bytes por chamada de fs_read/fs_write
 
-    static int do_copyout(int inumber, const char *filename, INE5412_FS *fs);
+    static int do_copyin(const char *filename, int inumber, INE5412_FS *fs, long *copied = 0);
+
+    static int do_copyout(int inumber, const char *filename, INE5412_FS *fs, long *copied = 0);
+
+    static int do_copyin_dir(const char *dirname, INE5412_FS *fs, long *copied = 0);
 
 };
 
 using namespace std;
 
-int main( int argc, char *argv[] )
+// executa uma linha de comando. Retorna 1 se o comando deu certo, 0 se falhou
+// e -1 para quit/exit. Em value fica o resultado do comando, quando houver (o
+// inode criado, o tamanho, os bytes ou arquivos copiados)
+static int run_command(INE5412_FS &fs, const char *line, long &value)
 {
-	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	std::vector<char> cmd_buf(strlen(line) + 1), arg1_buf(strlen(line) + 1), arg2_buf(strlen(line) + 1), arg3_buf(strlen(line) + 1);
+	char *cmd = &cmd_buf[0], *arg1 = &arg1_buf[0], *arg2 = &arg2_buf[0], *arg3 = &arg3_buf[0];
+	int args = sscanf(line, "%s %s %s %s", cmd, arg1, arg2, arg3);
+	bool ok = false;
 
-	if(argc != 3) {
-		cout << "use: " << argv[0] << " <diskfile> <nblocks>\n";
+	value = 0;
+	if(args <= 0) {
 		return 1;
 	}
 
-
-    Disk disk(argv[1], atoi(argv[2]));
-
-    INE5412_FS fs(&disk);
-
-	cout << "opened emulated disk image " << argv[1] << " with " << disk.size() << " blocks\n";
-
-	while(1) {
-		cout << " simplefs> ";
-		fflush(stdout);
-
-		if(!fgets(line,sizeof(line),stdin)) 
-            break;
-
-		if(line[0] == '\n') 
-            continue;
-
-		line[strlen(line)-1] = 0;
-
-		args = sscanf(line,"%s %s %s", cmd, arg1, arg2);
-
-		if(args == 0) 
-            continue;
-
-		if(!strcmp(cmd, "format")) {
-			if(args == 1) {
-				if(fs.fs_format()) {
-					cout << "disk formatted.\n";
-				} else {
-					cout << "format failed!\n";
-				}
+	if(!strcmp(cmd, "format")) {
+		// opções: fast (formatação rápida), extents (inodes com extents),
+		// indirect (inodes com ponteiros indiretos duplos e triplos) e inline
+		// (arquivos pequenos dentro do inode)
+		int flags = 0;
+		for(int i = 1; i < args; i++) {
+			const char *opt = i == 1 ? arg1 : i == 2 ? arg2 : arg3;
+			if(!strcmp(opt, "fast")) {
+				flags |= INE5412_FS::FORMAT_FAST;
+			} else if(!strcmp(opt, "extents")) {
+				flags |= INE5412_FS::FORMAT_EXTENTS;
+			} else if(!strcmp(opt, "indirect")) {
+				flags |= INE5412_FS::FORMAT_INDIRECT;
+			} else if(!strcmp(opt, "inline")) {
+				flags |= INE5412_FS::FORMAT_INLINE;
 			} else {
-				cout << "use: format\n";
+				flags = -1;
+				break;
 			}
-		} else if(!strcmp(cmd, "mount")) {
-			if(args == 1) {
-				if(fs.fs_mount()) {
-					cout << "disk mounted.\n";
-				} else {
-					cout << "mount failed!\n";
-				}
+		}
+		if(flags >= 0) {
+			if(fs.fs_format(flags)) {
+				cout << "disk formatted.\n";
+				ok = true;
 			} else {
-				cout << "use: mount\n";
+				cout << "format failed!\n";
 			}
-		} else if(!strcmp(cmd, "debug")) {
-			if(args == 1) {
-				fs.fs_debug();
+		} else {
+			cout << "use: format [fast] [extents|indirect] [inline]\n";
+		}
+	} else if(!strcmp(cmd, "mount")) {
+		if(args == 1) {
+			if(fs.fs_mount()) {
+				cout << "disk mounted.\n";
+				ok = true;
 			} else {
-				cout << "use: debug\n";
+				cout << "mount failed!\n";
 			}
-		} else if(!strcmp(cmd, "getsize")) {
-			if(args == 2) {
-				inumber = atoi(arg1);
-				result = fs.fs_getsize(inumber);
-				if(result >= 0) {
-					cout << "inode " << inumber << " has size " << result << "\n";
-				} else {
-					cout << "getsize failed!\n";
-				}
+		} else {
+			cout << "use: mount\n";
+		}
+	} else if(!strcmp(cmd, "debug")) {
+		if(args == 1) {
+			fs.fs_debug();
+			ok = true;
+		} else {
+			cout << "use: debug\n";
+		}
+	} else if(!strcmp(cmd, "getsize")) {
+		if(args == 2) {
+			int inumber = atoi(arg1);
+			int result = fs.fs_getsize(inumber);
+			if(result >= 0) {
+				cout << "inode " << inumber << " has size " << result << "\n";
+				value = result;
+				ok = true;
 			} else {
-				cout << "use: getsize <inumber>\n";
+				cout << "getsize failed!\n";
 			}
-			
-		} else if(!strcmp(cmd, "create")) {
-			if(args == 1) {
-				inumber = fs.fs_create();
-				if(inumber > 0) {
-					cout << "created inode " << inumber << "\n";
-				} else {
-					cout << "create failed!\n";
-				}
+		} else {
+			cout << "use: getsize <inumber>\n";
+		}
+		
+	} else if(!strcmp(cmd, "create")) {
+		if(args == 1) {
+			int inumber = fs.fs_create();
+			if(inumber > 0) {
+				cout << "created inode " << inumber << "\n";
+				value = inumber;
+				ok = true;
+			} else {
+				cout << "create failed!\n";
+			}
+		} else {
+			cout << "use: create\n";
+		}
+	} else if(!strcmp(cmd, "delete")) {
+		if(args == 2) {
+			int inumber = atoi(arg1);
+			if(fs.fs_delete(inumber)) {
+				cout << "inode " << inumber << " deleted.\n";
+				ok = true;
 			} else {
-				cout << "use: create\n";
+				cout << "delete failed!\n";	
 			}
-		} else if(!strcmp(cmd, "delete")) {
-			if(args == 2) {
-				inumber = atoi(arg1);
-				if(fs.fs_delete(inumber)) {
-					cout << "inode " << inumber << " deleted.\n";
-				} else {
-					cout << "delete failed!\n";	
-				}
+		} else {
+			cout << "use: delete <inumber>\n";
+		}
+	} else if(!strcmp(cmd, "cat")) {
+		if(args==2) {
+			int inumber = atoi(arg1);
+			if(File_Ops::do_copyout(inumber, "/dev/stdout", &fs, &value)) {
+				ok = true;
 			} else {
-				cout << "use: delete <inumber>\n";
+				cout << "cat failed!\n";
 			}
-		} else if(!strcmp(cmd, "cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!File_Ops::do_copyout(inumber, "/dev/stdout", &fs)) {
-					cout << "cat failed!\n";
-				}
+		} else {
+			cout << "use: cat <inumber>\n";
+		}
+
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			int inumber = atoi(arg2);
+			if(File_Ops::do_copyin(arg1, inumber, &fs, &value)) {
+				cout << "copied file " << arg1 << " to inode " << inumber << "\n";
+				ok = true;
 			} else {
-				cout << "use: cat <inumber>\n";
+				cout << "copy failed!\n";
 			}
+		} else {
+			cout << "use: copyin <filename> <inumber>\n";
+		}
 
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(File_Ops::do_copyin(arg1, inumber, &fs)) {
-					cout << "copied file " << arg1 << " to inode " << inumber << "\n";
-				} else {
-					cout << "copy failed!\n";
-				}
+	} else if(!strcmp(cmd, "copyout")) {
+		if(args == 3) {
+			int inumber = atoi(arg1);
+			if(File_Ops::do_copyout(inumber, arg2, &fs, &value)) {
+				cout << "copied inode " << inumber << " to file " << arg2 << "\n";
+				ok = true;
 			} else {
-				cout << "use: copyin <filename> <inumber>\n";
+				cout << "copy failed!\n";
 			}
+		} else {
+			cout << "use: copyout <inumber> <filename>\n";
+		}
 
-		} else if(!strcmp(cmd, "copyout")) {
-			if(args == 3) {
-				inumber = atoi(arg1);
-				if(File_Ops::do_copyout(inumber, arg2, &fs)) {
-					cout << "copied inode " << inumber << " to file " << arg2 << "\n";
-				} else {
-					cout << "copy failed!\n";
-				}
+	} else if(!strcmp(cmd, "punch")) {
+		if(args == 4) {
+			int inumber = atoi(arg1);
+			if(fs.fs_punch(inumber, atoi(arg2), atoi(arg3))) {
+				cout << "punched " << arg3 << " bytes at offset " << arg2 << " of inode " << inumber << "\n";
+				ok = true;
 			} else {
-				cout << "use: copyout <inumber> <filename>\n";
+				cout << "punch failed!\n";
 			}
+		} else {
+			cout << "use: punch <inumber> <offset> <length>\n";
+		}
 
-		} else if(!strcmp(cmd, "help")) {
-			cout << "Commands are:\n";
-			cout << "    format\n";
-			cout << "    mount\n";
-			cout << "    debug\n";
-			cout << "    create\n";
-			cout << "    delete  <inode>\n";
-			cout << "    cat     <inode>\n";
-			cout << "    copyin  <file> <inode>\n";
-			cout << "    copyout <inode> <file>\n";
-			cout << "    help\n";
-			cout << "    quit\n";
-			cout << "    exit\n";
-		} else if(!strcmp(cmd, "quit")) {
-			break;
-		} else if(!strcmp(cmd, "exit")) {
-			break;
+	} else if(!strcmp(cmd, "sync")) {
+		if(args == 1) {
+			fs.fs_sync();
+			cout << "disk synced.\n";
+			ok = true;
 		} else {
-			cout << "unknown command: " << cmd << "\n";
-			cout << "type 'help' for a list of commands.\n";
-			result = 1;
+			cout << "use: sync\n";
+		}
+	} else if(!strcmp(cmd, "copyin-dir")) {
+		if(args == 2) {
+			if(File_Ops::do_copyin_dir(arg1, &fs, &value)) {
+				cout << "copied " << value << " files from " << arg1 << "\n";
+				ok = true;
+			} else {
+				cout << "copy failed!\n";
+			}
+		} else {
+			cout << "use: copyin-dir <directory>\n";
+		}
+	} else if(!strcmp(cmd, "check")) {
+		if(args == 1) {
+			if(fs.fs_check()) {
+				cout << "disk is consistent.\n";
+				ok = true;
+			} else {
+				cout << "check failed!\n";
+			}
+		} else {
+			cout << "use: check\n";
+		}
+	} else if(!strcmp(cmd, "stats")) {
+		// stats: contadores em texto; stats json [arquivo]: em JSON; stats reset: zera
+		if(args == 1) {
+			fs.fs_stats(cout, false);
+			ok = true;
+		} else if(args == 2 && !strcmp(arg1, "reset")) {
+			fs.fs_stats_reset();
+			cout << "stats reset.\n";
+			ok = true;
+		} else if(args == 2 && !strcmp(arg1, "json")) {
+			fs.fs_stats(cout, true);
+			ok = true;
+		} else if(args == 3 && !strcmp(arg1, "json")) {
+			ofstream out(arg2);
+			if(out) {
+				fs.fs_stats(out, true);
+				cout << "stats written to " << arg2 << "\n";
+				ok = true;
+			} else {
+				cout << "couldn't open " << arg2 << "\n";
+			}
+		} else {
+			cout << "use: stats [reset | json [file]]\n";
+		}
+	} else if(!strcmp(cmd, "help")) {
+		cout << "Commands are:\n";
+		cout << "    format [fast] [extents|indirect] [inline]\n";
+		cout << "    mount\n";
+		cout << "    debug\n";
+		cout << "    create\n";
+		cout << "    delete  <inode>\n";
+		cout << "    cat     <inode>\n";
+		cout << "    copyin  <file> <inode>\n";
+		cout << "    copyout <inode> <file>\n";
+		cout << "    copyin-dir <directory>\n";
+		cout << "    punch   <inode> <offset> <length>\n";
+		cout << "    sync\n";
+		cout << "    check\n";
+		cout << "    stats   [reset | json [file]]\n";
+		cout << "    help\n";
+		cout << "    quit\n";
+		cout << "    exit\n";
+		ok = true;
+	} else if(!strcmp(cmd, "quit") || !strcmp(cmd, "exit")) {
+		return -1;
+	} else {
+		cout << "unknown command: " << cmd << "\n";
+		cout << "type 'help' for a list of commands.\n";
+	}
+	return ok ? 1 : 0;
+}
+
+// separa os comandos do -c, divididos por ';'
+static void split_commands(const char *text, std::vector<string> &commands)
+{
+	string cur;
+	for(const char *c = text; ; c++) {
+		if(*c == ';' || *c == 0) {
+			commands.push_back(cur);
+			cur.clear();
+			if(*c == 0) break;
+		} else {
+			cur += *c;
+		}
+	}
+}
+
+// lê os comandos de um script (ou da entrada padrão, com "-"), um por linha.
+// Linhas que começam com '#' são comentários
+static bool read_script(const char *filename, std::vector<string> &commands)
+{
+	FILE *file = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if(!file) {
+		cerr << "ERROR: couldn't open " << filename << endl;
+		return false;
+	}
+
+	char line[1024];
+	string cur;
+	while(fgets(line, sizeof(line), file)) {
+		cur += line;
+		if(cur.empty() || cur[cur.size() - 1] != '\n') {
+			continue;   // linha maior que o buffer
+		}
+		cur.erase(cur.size() - 1);
+		std::size_t first = cur.find_first_not_of(" \t");
+		if(first != string::npos && cur[first] != '#') {
+			commands.push_back(cur);
+		}
+		cur.clear();
+	}
+	if(!cur.empty()) {
+		commands.push_back(cur);
+	}
+	if(file != stdin) {
+		fclose(file);
+	}
+	return true;
+}
+
+// comandos cuja saída é o resultado pedido, impressa mesmo no modo quieto
+static bool prints_data(const char *line)
+{
+	char cmd[32] = "";
+	sscanf(line, "%31s", cmd);
+	return !strcmp(cmd, "cat") || !strcmp(cmd, "debug") || !strcmp(cmd, "stats") || !strcmp(cmd, "help");
+}
+
+int main( int argc, char *argv[] )
+{
+	char line[1024];
+	int opt;
+	bool bad_args = false;
+	Disk::Backend backend = Disk::BACKEND_PREAD;
+	int queue_depth = Disk::DEFAULT_QUEUE_DEPTH;
+	bool direct = false;
+	bool print_bitmap = false;
+	bool batch = false;
+	bool quiet = false;
+	bool timing = false;
+	std::vector<string> commands;
+
+	// -m: acessa a imagem com mmap em vez de pread/pwrite
+	// -u: usa a fila assíncrona do io_uring, com -q <profundidade> e -d para O_DIRECT
+	// -b: imprime o bitmap de blocos livres a cada mount
+	// -f <script> e -c "cmd; cmd": executa os comandos sem prompt e sai
+	// -s: modo quieto, sem as mensagens dos comandos; cada comando imprime uma
+	//     linha "<comando>\t<ok|fail>\t<valor>\t<segundos>"
+	// -t: imprime o tempo de cada comando
+	while((opt = getopt(argc, argv, "muq:dbf:c:st")) != -1) {
+		if(opt == 'm') {
+			backend = Disk::BACKEND_MMAP;
+		} else if(opt == 'u') {
+			backend = Disk::BACKEND_URING;
+		} else if(opt == 'q') {
+			queue_depth = atoi(optarg);
+		} else if(opt == 'd') {
+			direct = true;
+		} else if(opt == 'b') {
+			print_bitmap = true;
+		} else if(opt == 'f') {
+			batch = true;
+			bad_args = bad_args || !read_script(optarg, commands);
+		} else if(opt == 'c') {
+			batch = true;
+			split_commands(optarg, commands);
+		} else if(opt == 's') {
+			quiet = true;
+		} else if(opt == 't') {
+			timing = true;
+		} else {
+			bad_args = true;
+		}
+	}
+
+	if(bad_args || argc - optind != 2) {
+		cout << "use: " << argv[0] << " [-b] [-m | -u [-q depth] [-d]] [-f script | -c \"cmd; cmd\"] [-s] [-t]"
+		     << " <diskfile> <nblocks>\n";
+		return 1;
+	}
+	const char *diskfile = argv[optind];
+	int nblocks = atoi(argv[optind + 1]);
+
+	// no modo quieto as mensagens vão para lugar nenhum; as linhas de resultado
+	// e a saída do cat, debug e stats vão para a saída padrão
+	streambuf *out = cout.rdbuf();
+	if(quiet) {
+		cout.rdbuf(0);
+	}
+
+    Disk disk(diskfile, nblocks, backend, queue_depth, direct);
+
+    INE5412_FS fs(&disk);
+    fs.set_print_bitmap(print_bitmap);
+
+	cout << "opened emulated disk image " << diskfile << " with " << disk.size() << " blocks\n";
+
+	int failed = 0;
+	for(std::size_t next = 0; ; next++) {
+		string command;
+		if(batch) {
+			if(next == commands.size())
+				break;
+			command = commands[next];
+		} else {
+			cout << " simplefs> ";
+			fflush(stdout);
+
+			if(!fgets(line,sizeof(line),stdin)) 
+				break;
+
+			line[strcspn(line, "\n")] = 0;
+			command = line;
+		}
+
+		std::size_t first = command.find_first_not_of(" \t");
+		if(first == string::npos)
+			continue;
+		command.erase(0, first);
+		command.erase(command.find_last_not_of(" \t") + 1);
+
+		if(quiet && prints_data(command.c_str())) {
+			cout.rdbuf(out);
+		}
+
+		long value;
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		int status = run_command(fs, command.c_str(), value);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		fflush(stdout);
+
+		if(status < 0)
+			break;
+		failed += !status;
+
+		if(quiet) {
+			cout.rdbuf(0);
+			printf("%s\t%s\t%ld\t%.6f\n", command.c_str(), status ? "ok" : "fail", value, seconds);
+		} else if(timing) {
+			printf("(%.3f ms)\n", seconds * 1000);
 		}
 	}
 
 	cout << "closing emulated disk.\n";
+	fs.fs_unmount();
 	disk.close();
+	cout.rdbuf(out);
 
-	return 0;
+	return failed ? 2 : 0;
 }
 
-int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
+int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs, long *copied)
 {
 	FILE *file;
 	int offset=0, result, actual;
-	char buffer[16384];
+	std::vector<char> buffer(COPY_BUFFER_SIZE);
 
 	file = fopen(filename, "r");
 	if(!file) {
@@ -191,10 +455,10 @@ int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 	}
 
 	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
+		result = fread(&buffer[0],1,buffer.size(),file);
 		if(result <= 0) break;
 		if(result > 0) {
-			actual = fs->fs_write(inumber,buffer,result,offset);
+			actual = fs->fs_write(inumber,&buffer[0],result,offset);
 			if(actual<0) {
 				cout << "ERROR: fs_write return invalid result " << actual << "\n";
 				break;
@@ -208,17 +472,18 @@ int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 	}
 
 	cout << offset << " bytes copied\n";
+	if(copied) *copied = offset;
 
     fclose(file);
 
 	return 1;
 }
 
-int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
+int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs, long *copied)
 {
 	FILE *file;
 	int offset = 0, result;
-	char buffer[16384];
+	std::vector<INE5412_FS::fs_view> views;
 
 	file = fopen(filename,"w");
 	if(!file) {
@@ -226,16 +491,60 @@ int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 		return 0;
 	}
 
+	// escreve direto dos blocos do cache ou da imagem mapeada, sem copiar antes
 	while(1) {
-		result = fs->fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs->fs_read_view(inumber,views,COPY_BUFFER_SIZE,offset);
 		if(result<=0) break;
-		fwrite(buffer,1,result,file);
+		for(std::size_t i = 0; i < views.size(); i++) {
+			fwrite(views[i].data,1,views[i].length,file);
+		}
 		offset += result;
 	}
+	fs->fs_release_view(views);
 
 	cout << offset << " bytes copied\n";
+	if(copied) *copied = offset;
 
 	fclose(file);
 	return 1;
 }
 
+// copia os arquivos regulares do diretório do host (sem entrar nos
+// subdiretórios), em ordem de nome, para inodes novos, reservados de uma vez
+// com fs_create_many. Em copied fica o número de arquivos copiados
+int File_Ops::do_copyin_dir(const char *dirname, INE5412_FS *fs, long *copied)
+{
+	DIR *dir = opendir(dirname);
+	if(!dir) {
+		cout << "couldn't open " << dirname << "\n";
+		return 0;
+	}
+
+	std::vector<string> files;
+	struct dirent *entry;
+	while((entry = readdir(dir))) {
+		string path = string(dirname) + "/" + entry->d_name;
+		struct stat st;
+		if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+			files.push_back(path);
+		}
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+
+	std::vector<int> inumbers;
+	int n = fs->fs_create_many(files.size(), inumbers);
+	if(n < (int)files.size()) {
+		cout << "WARNING: only " << n << " inodes available for " << files.size() << " files\n";
+	}
+
+	long count = 0;
+	for(int i = 0; i < n; i++) {
+		if(do_copyin(files[i].c_str(), inumbers[i], fs)) {
+			cout << "copied file " << files[i] << " to inode " << inumbers[i] << "\n";
+			count++;
+		}
+	}
+	if(copied) *copied = count;
+	return n > 0 || files.empty();
+}
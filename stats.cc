@@ -0,0 +1,50 @@
+#include "stats.h"
+
+void Op_Stats::add(uint64_t ns, uint64_t bytes)
+{
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    ncalls.fetch_add(1, std::memory_order_relaxed);
+    nbytes.fetch_add(bytes, std::memory_order_relaxed);
+    ntotal_ns.fetch_add(ns, std::memory_order_relaxed);
+    buckets[b < BUCKETS ? b : BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t old = nmax_ns.load(std::memory_order_relaxed);
+    while (ns > old && !nmax_ns.compare_exchange_weak(old, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void Op_Stats::reset()
+{
+    ncalls = 0;
+    nbytes = 0;
+    ntotal_ns = 0;
+    nmax_ns = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+}
+
+// retorna o limite superior, em us, do bucket onde está o percentil p (0 a 100)
+// das latências, ou 0 se não houve chamadas
+uint64_t Op_Stats::percentile(double p)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        total += buckets[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen) {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << (BUCKETS - 1);
+}
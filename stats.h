@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// contadores de uma operação do sistema de arquivos: chamadas, bytes, tempo total
+// e um histograma de latência. Pode ser atualizado por várias threads sem lock;
+// lidos com operações em andamento, os contadores podem estar defasados entre si
+class Op_Stats
+{
+public:
+    static const int BUCKETS = 32;  // o bucket i conta as latências < 2^i us (o 0, as < 1 us)
+
+    void add(uint64_t ns, uint64_t bytes);
+    void reset();
+    uint64_t percentile(double p);
+
+    uint64_t calls() { return ncalls; }
+    uint64_t bytes() { return nbytes; }
+    uint64_t total_ns() { return ntotal_ns; }
+    uint64_t max_ns() { return nmax_ns; }
+    uint64_t bucket(int i) { return buckets[i]; }
+
+private:
+    std::atomic<uint64_t> ncalls{0};
+    std::atomic<uint64_t> nbytes{0};
+    std::atomic<uint64_t> ntotal_ns{0};
+    std::atomic<uint64_t> nmax_ns{0};
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+};
+
+// mede uma chamada, do construtor ao destrutor, e soma em stats. Quem conhece
+// os bytes transferidos os guarda em bytes antes de retornar
+class Op_Timer
+{
+public:
+    Op_Timer(Op_Stats &s) : stats(s), start(std::chrono::steady_clock::now()) {}
+    ~Op_Timer() {
+        std::chrono::steady_clock::duration d = std::chrono::steady_clock::now() - start;
+        stats.add(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), bytes);
+    }
+
+    uint64_t bytes = 0;
+
+private:
+    Op_Stats &stats;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
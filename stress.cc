@@ -0,0 +1,393 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// teste de estresse do SimpleFS com várias threads. Cada thread cria, escreve
+// (com buracos e blocos de zeros), lê, abre buracos com o fs_punch e apaga os
+// próprios arquivos, conferindo cada leitura e cada tamanho com uma cópia na
+// memória, enquanto todas leem ao mesmo tempo um arquivo compartilhado. Os
+// inumbers das threads caem nos mesmos locks de inode, e fs_sync no meio das
+// operações disputa o commit do journal com elas. No fim o disco é montado de
+// novo, conferido pelo fs_check (dono único de cada bloco, bitmaps iguais aos
+// inodes) e o conteúdo de todos os arquivos é conferido outra vez. Depois,
+// numa imagem pequena, confere os casos de disco cheio: uma escrita que não
+// cabe falha sem mudar o arquivo
+
+using namespace std;
+
+class Stress
+{
+public:
+	static const int MAX_FILES = 8;        // arquivos de cada thread ao mesmo tempo
+	static const int MAX_WRITE = 64 << 10; // bytes por escrita, no máximo
+	static const int MAX_SIZE = 1 << 20;   // tamanho máximo dos arquivos das threads
+	static const int SHARED_SIZE = 4 << 20;    // tamanho do arquivo compartilhado
+
+	Disk::Backend backend = Disk::BACKEND_PREAD;
+	int nblocks = 32768;
+	int nthreads = 8;
+	int iterations = 300;   // operações por thread
+	int layout = 0;         // flags do fs_format
+	int write_buffer = INE5412_FS::WRITE_BUFFER_SIZE;
+	unsigned seed = 1;
+	string image = "stress.img";
+
+	int run();
+	int run_full();
+
+private:
+	// arquivo de uma thread e o conteúdo esperado
+	typedef map<int, vector<char> > Files;
+
+	void worker(int id);
+	void fail(int id, const char *what, int inumber, int offset);
+	bool check_file(int inumber, const vector<char> &expected);
+	void fill_disk();
+
+	INE5412_FS *fs = 0;
+	vector<char> shared;
+	int shared_inumber = 0;
+	vector<Files> files;    // arquivos de cada thread, para a conferência final
+	atomic<long> ops{0};
+	atomic<long> errors{0};
+	mutex report_lock;
+};
+
+void Stress::fail(int id, const char *what, int inumber, int offset)
+{
+	lock_guard<mutex> guard(report_lock);
+	fprintf(stderr, "thread %d: %s (inode %d, offset %d)\n", id, what, inumber, offset);
+	errors++;
+}
+
+// lê o arquivo inteiro e compara com expected
+bool Stress::check_file(int inumber, const vector<char> &expected)
+{
+	if(fs->fs_getsize(inumber) != (int)expected.size()) {
+		return false;
+	}
+	vector<char> data(expected.size() + 1);
+	int n = expected.empty() ? 0 : fs->fs_read(inumber, &data[0], expected.size(), 0);
+	return n == (int)expected.size() && equal(expected.begin(), expected.end(), data.begin());
+}
+
+void Stress::worker(int id)
+{
+	mt19937 rng(seed * 1000 + id);
+	Files &mine = files[id];
+	vector<char> buf;
+
+	for(int it = 0; it < iterations; it++) {
+		int op = rng() % 100;
+
+		// sem arquivos, ou de vez em quando, cria um
+		if(mine.empty() || (op < 10 && (int)mine.size() < MAX_FILES)) {
+			int inumber = fs->fs_create();
+			if(inumber <= 0) {
+				fail(id, "create failed", inumber, 0);
+				continue;
+			}
+			if(mine.count(inumber)) {
+				fail(id, "create returned a file in use", inumber, 0);
+			}
+			mine[inumber].clear();
+			ops++;
+			continue;
+		}
+
+		Files::iterator f = mine.begin();
+		advance(f, rng() % mine.size());
+		int inumber = f->first;
+		vector<char> &data = f->second;
+
+		if(op < 45) {
+			// escrita: no meio, no fim ou depois do fim (buraco), com trechos de zeros
+			int offset = rng() % (data.size() + MAX_WRITE / 4 + 1);
+			int length = 1 + rng() % MAX_WRITE;
+			if(offset + length > MAX_SIZE) {
+				continue;
+			}
+			buf.resize(length);
+			bool zeros = rng() % 4 == 0;
+			for(int i = 0; i < length; i++) {
+				buf[i] = zeros && i < length / 2 ? 0 : (char)rng();
+			}
+			int n = fs->fs_write(inumber, &buf[0], length, offset);
+			if(n != length) {
+				fail(id, "short write", inumber, offset);
+				continue;
+			}
+			if((int)data.size() < offset + length) {
+				data.resize(offset + length, 0);
+			}
+			copy(buf.begin(), buf.end(), data.begin() + offset);
+		} else if(op < 70) {
+			// leitura de um trecho
+			if(data.empty()) {
+				continue;
+			}
+			int offset = rng() % data.size();
+			int length = 1 + rng() % MAX_WRITE;
+			int expected = min(length, (int)data.size() - offset);
+			buf.assign(length, 0x5a);
+			int n = fs->fs_read(inumber, &buf[0], length, offset);
+			if(n != expected || !equal(buf.begin(), buf.begin() + expected, data.begin() + offset)) {
+				fail(id, "read returned wrong data", inumber, offset);
+			}
+		} else if(op < 80) {
+			// buraco num trecho do arquivo
+			int offset = rng() % (data.size() + 1);
+			int length = rng() % (MAX_WRITE * 2);
+			if(!fs->fs_punch(inumber, offset, length)) {
+				fail(id, "punch failed", inumber, offset);
+				continue;
+			}
+			for(int i = offset; i < (int)data.size() && i < offset + length; i++) {
+				data[i] = 0;
+			}
+		} else if(op < 85) {
+			if(fs->fs_getsize(inumber) != (int)data.size()) {
+				fail(id, "getsize returned the wrong size", inumber, 0);
+			}
+		} else if(op < 93) {
+			// confere o arquivo inteiro e apaga
+			if(!check_file(inumber, data)) {
+				fail(id, "file contents differ before delete", inumber, 0);
+			}
+			if(!fs->fs_delete(inumber)) {
+				fail(id, "delete failed", inumber, 0);
+			}
+			mine.erase(f);
+		} else if(op < 98) {
+			// leitura do arquivo compartilhado, em paralelo com as outras threads
+			int offset = rng() % shared.size();
+			int length = min((int)shared.size() - offset, 1 + (int)(rng() % MAX_WRITE));
+			buf.resize(length);
+			int n = fs->fs_read(shared_inumber, &buf[0], length, offset);
+			if(n != length || !equal(buf.begin(), buf.end(), shared.begin() + offset)) {
+				fail(id, "read of the shared file returned wrong data", shared_inumber, offset);
+			}
+		} else {
+			fs->fs_sync();
+		}
+		ops++;
+	}
+}
+
+// roda o teste e retorna o n de erros encontrados
+int Stress::run()
+{
+	Disk disk(image.c_str(), nblocks, backend);
+	INE5412_FS filesystem(&disk);
+	fs = &filesystem;
+
+	if(!fs->fs_format(layout) || !fs->fs_mount()) {
+		fprintf(stderr, "couldn't format and mount %s\n", image.c_str());
+		return 1;
+	}
+	fs->set_write_buffer(write_buffer);
+
+	// arquivo compartilhado, só lido pelas threads
+	mt19937 rng(seed);
+	shared.resize(SHARED_SIZE);
+	for(size_t i = 0; i < shared.size(); i++) {
+		shared[i] = rng();
+	}
+	shared_inumber = fs->fs_create();
+	if(fs->fs_write(shared_inumber, &shared[0], shared.size(), 0) != (int)shared.size()) {
+		fprintf(stderr, "couldn't write the shared file\n");
+		return 1;
+	}
+
+	files.assign(nthreads, Files());
+	vector<thread> workers;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for(int i = 0; i < nthreads; i++) {
+		workers.push_back(thread(&Stress::worker, this, i));
+	}
+	for(int i = 0; i < nthreads; i++) {
+		workers[i].join();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// monta de novo e confere os bitmaps e o conteúdo de todos os arquivos
+	fs->fs_unmount();
+	if(!fs->fs_mount()) {
+		fprintf(stderr, "couldn't mount %s again\n", image.c_str());
+		return errors + 1;
+	}
+	if(!fs->fs_check()) {
+		fprintf(stderr, "fs_check found inconsistencies after remount\n");
+		errors++;
+	}
+	int nfiles = 0;
+	for(int t = 0; t < nthreads; t++) {
+		for(Files::iterator f = files[t].begin(); f != files[t].end(); f++) {
+			if(!check_file(f->first, f->second)) {
+				fail(t, "file contents differ after remount", f->first, 0);
+			}
+			nfiles++;
+		}
+	}
+	if(!check_file(shared_inumber, shared)) {
+		fail(-1, "shared file differs after remount", shared_inumber, 0);
+	}
+	fs->fs_unmount();
+
+	fprintf(stderr, "%d threads, %ld operations in %.3f s, %d files checked, %ld errors\n",
+	        nthreads, ops.load(), seconds, nfiles + 1, errors.load());
+	return errors;
+}
+
+// função auxiliar que enche o disco: escreve direto (sem buffer) num arquivo até
+// faltar espaço, e depois cria arquivos de um bloco, que não precisam de blocos
+// de ponteiros, até não sobrar nenhum
+void Stress::fill_disk()
+{
+	vector<char> block(Disk::DISK_BLOCK_SIZE, 0x66);
+	fs->set_write_buffer(0);
+	int inumber = fs->fs_create();
+	for(int offset = 0; fs->fs_write(inumber, &block[0], block.size(), offset) == (int)block.size(); offset += block.size());
+	while((inumber = fs->fs_create()) > 0 && fs->fs_write(inumber, &block[0], block.size(), 0) > 0);
+	fs->fs_sync();
+	fs->set_write_buffer(write_buffer);
+}
+
+// casos de disco cheio numa imagem pequena; retorna o n de erros encontrados
+int Stress::run_full()
+{
+	long before = errors;
+	Disk disk(image.c_str(), 400, backend);
+	INE5412_FS filesystem(&disk);
+	fs = &filesystem;
+
+	// um arquivo dentro do inode que deixa de caber nele precisa de um bloco: sem
+	// nenhum livre, a escrita falha e os bytes que já estavam no inode continuam lá
+	vector<char> small(23, 0x11);
+	vector<char> more(25, 0x22);
+	fs->fs_format(layout | INE5412_FS::FORMAT_INLINE);
+	fs->fs_mount();
+	fs->set_write_buffer(write_buffer);
+	int inumber = fs->fs_create();
+	fs->fs_write(inumber, &small[0], small.size(), 0);
+	fill_disk();
+	if(fs->fs_write(inumber, &more[0], more.size(), 38) != 0) {
+		fail(-1, "write past an inline file succeeded on a full disk", inumber, 38);
+	}
+	if(!check_file(inumber, small)) {
+		fail(-1, "inline file changed by a failed write", inumber, 0);
+	}
+	fs->fs_unmount();
+	fs->fs_mount();
+	if(!check_file(inumber, small) || !fs->fs_check()) {
+		fail(-1, "inline file or disk inconsistent after a failed write and remount", inumber, 0);
+	}
+	fs->fs_unmount();
+
+	// buraco no fim de um arquivo com extents que precisaria do bloco overflow: sem
+	// ele o trecho é zerado no lugar, e o tamanho continua o mesmo
+	vector<char> data(10545);
+	for(size_t i = 0; i < data.size(); i++) {
+		data[i] = 1 + i % 251;
+	}
+	vector<char> other(Disk::DISK_BLOCK_SIZE, 0x33);
+	fs->fs_format(INE5412_FS::FORMAT_EXTENTS);
+	fs->fs_mount();
+	fs->set_write_buffer(write_buffer);
+	inumber = fs->fs_create();
+	int separator = fs->fs_create();
+	fs->fs_write(inumber, &data[0], Disk::DISK_BLOCK_SIZE, 0);
+	fs->fs_sync();
+	fs->fs_write(separator, &other[0], other.size(), 0);  // o resto do arquivo vai para outro extent
+	fs->fs_sync();
+	fs->fs_write(inumber, &data[Disk::DISK_BLOCK_SIZE], data.size() - Disk::DISK_BLOCK_SIZE, Disk::DISK_BLOCK_SIZE);
+	fill_disk();
+	if(!fs->fs_punch(inumber, 7127, 17943)) {
+		fail(-1, "punch failed on a full disk", inumber, 7127);
+	}
+	fill(data.begin() + 7127, data.end(), 0);
+	if(!check_file(inumber, data)) {
+		fail(-1, "punch on a full disk changed the size or the data outside the hole", inumber, 7127);
+	}
+	fs->fs_unmount();
+	fs->fs_mount();
+	if(!check_file(inumber, data) || !fs->fs_check()) {
+		fail(-1, "file or disk inconsistent after punch and remount", inumber, 7127);
+	}
+	fs->fs_unmount();
+
+	fprintf(stderr, "full disk cases: %ld errors\n", errors - before);
+	return errors - before;
+}
+
+int main(int argc, char *argv[])
+{
+	Stress stress;
+	bool bad_args = false;
+	int opt;
+
+	// -m/-u: backend do Disk, como no shell; -n: blocos da imagem; -i: caminho da imagem
+	// -t: threads; -o: operações por thread; -s: semente
+	// -f pointers|extents|indirect|inline: formato dos inodes (inline usa ponteiros indiretos)
+	// -b: bytes dos buffers de escrita (0 = escreve direto)
+	while((opt = getopt(argc, argv, "mun:i:t:o:s:f:b:")) != -1) {
+		if(opt == 'm') {
+			stress.backend = Disk::BACKEND_MMAP;
+		} else if(opt == 'u') {
+			stress.backend = Disk::BACKEND_URING;
+		} else if(opt == 'n') {
+			stress.nblocks = atoi(optarg);
+		} else if(opt == 'i') {
+			stress.image = optarg;
+		} else if(opt == 't') {
+			stress.nthreads = atoi(optarg);
+		} else if(opt == 'o') {
+			stress.iterations = atoi(optarg);
+		} else if(opt == 's') {
+			stress.seed = atoi(optarg);
+		} else if(opt == 'f' && !strcmp(optarg, "pointers")) {
+			stress.layout = 0;
+		} else if(opt == 'f' && !strcmp(optarg, "extents")) {
+			stress.layout = INE5412_FS::FORMAT_EXTENTS;
+		} else if(opt == 'f' && !strcmp(optarg, "indirect")) {
+			stress.layout = INE5412_FS::FORMAT_INDIRECT;
+		} else if(opt == 'f' && !strcmp(optarg, "inline")) {
+			stress.layout = INE5412_FS::FORMAT_INDIRECT | INE5412_FS::FORMAT_INLINE;
+		} else if(opt == 'b') {
+			stress.write_buffer = atoi(optarg);
+		} else {
+			bad_args = true;
+		}
+	}
+
+	// cada thread tem até MAX_FILES arquivos de até MAX_SIZE, mais o compartilhado, e sobra
+	// um quarto para os blocos de metadados
+	long needed = ((long)stress.nthreads * Stress::MAX_FILES * Stress::MAX_SIZE + Stress::SHARED_SIZE) / Disk::DISK_BLOCK_SIZE * 5 / 4;
+	if(bad_args || optind != argc || stress.nthreads < 1 || stress.iterations < 1 || needed > stress.nblocks) {
+		cout << "use: " << argv[0] << " [-m | -u] [-f pointers|extents|indirect|inline] [-n nblocks]"
+		     << " [-t threads] [-o operations] [-s seed] [-b buffer bytes] [-i image]\n";
+		cout << "(-n must be at least " << needed << " for the chosen number of threads)\n";
+		return 2;
+	}
+
+	// as mensagens do fs e do Disk não se misturam com o resultado
+	streambuf *out = cout.rdbuf(0);
+	int errors = stress.run();
+	errors += stress.run_full();
+	cout.rdbuf(out);
+	return errors ? 1 : 0;
+}
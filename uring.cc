@@ -0,0 +1,221 @@
+#include "uring.h"
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, 0, 0);
+}
+
+IO_Uring::IO_Uring(int f, int bsize, int depth, bool dir)
+{
+    fd = f;
+    block_size = bsize;
+    qdepth = depth < 1 ? 1 : depth;
+    direct = dir;
+    inflight = 0;
+    unsubmitted = 0;
+    sq_ptr = cq_ptr = sqes_ptr = 0;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = io_uring_setup(qdepth, &p);
+    if (ring_fd < 0) {
+        return;
+    }
+
+    // mapeia a SQ, a CQ (no mesmo mapeamento se o kernel suportar) e o vetor de SQEs
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = max(sq_size, cq_size);
+    }
+
+    sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        sq_ptr = 0;
+        ::close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ptr = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    // sem algum dos anéis, desfaz o que foi mapeado e a fila fica indisponível
+    // (ok() falso), como quando o io_uring_setup falha: o Disk usa pread/pwrite
+    if (cq_ptr == MAP_FAILED || sqes_ptr == MAP_FAILED) {
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = 0;
+        }
+        if (sqes_ptr == MAP_FAILED) {
+            sqes_ptr = 0;
+        }
+        release();
+        return;
+    }
+
+    sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+    sqes = sqes_ptr;
+    cqes = (char *)cq_ptr + p.cq_off.cqes;
+
+    // uma requisição por posição da fila; com O_DIRECT cada uma tem seu buffer alinhado
+    requests.resize(qdepth);
+    for (int i = 0; i < qdepth; i++) {
+        requests[i].bounce = 0;
+        if (direct && posix_memalign((void **)&requests[i].bounce, block_size, block_size)) {
+            requests[i].bounce = 0;
+            release();
+            return;
+        }
+        free_requests.push_back(qdepth - 1 - i);
+    }
+}
+
+IO_Uring::~IO_Uring()
+{
+    if (ring_fd < 0) {
+        return;
+    }
+    wait_all();
+    release();
+}
+
+// libera os buffers e os anéis mapeados até agora e fecha a fila
+void IO_Uring::release()
+{
+    for (std::size_t i = 0; i < requests.size(); i++) {
+        free(requests[i].bounce);
+    }
+    requests.clear();
+    free_requests.clear();
+    if (sqes_ptr) {
+        munmap(sqes_ptr, sqes_size);
+    }
+    if (cq_ptr && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr) {
+        munmap(sq_ptr, sq_size);
+    }
+    sq_ptr = cq_ptr = sqes_ptr = 0;
+    ::close(ring_fd);
+    ring_fd = -1;
+}
+
+// envia as requisições pendentes e espera até min_complete terminarem
+void IO_Uring::enter(int min_complete)
+{
+    int r = io_uring_enter(ring_fd, unsubmitted, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (r < 0) {
+        cout << "ERROR: couldn't access simulated disk\n";
+        abort();
+    }
+    unsubmitted -= r < unsubmitted ? r : unsubmitted;
+    reap();
+}
+
+// processa as requisições completadas na CQ
+void IO_Uring::reap()
+{
+    unsigned head = *cq_head;
+
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &((struct io_uring_cqe *)cqes)[head & *cq_mask];
+        request &req = requests[cqe->user_data];
+
+        if (cqe->res != block_size) {
+            cout << "ERROR: couldn't access simulated disk\n";
+            abort();
+        }
+        if (req.bounce && !req.writing) {
+            memcpy(req.data, req.bounce, block_size);
+        }
+
+        free_requests.push_back(cqe->user_data);
+        inflight--;
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// coloca a leitura/escrita de um bloco na fila. Se a fila estiver cheia,
+// espera alguma requisição terminar antes
+void IO_Uring::submit(int blocknum, char *data, bool writing)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    while (inflight == qdepth) {
+        enter(1);
+    }
+
+    int id = free_requests.back();
+    free_requests.pop_back();
+    request &req = requests[id];
+    req.data = data;
+    req.writing = writing;
+
+    char *buf = data;
+    if (req.bounce) {
+        buf = req.bounce;
+        if (writing) {
+            memcpy(buf, data, block_size);
+        }
+    }
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)sqes)[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = block_size;
+    sqe->off = (unsigned long long)blocknum * block_size;
+    sqe->user_data = id;
+
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+    inflight++;
+
+    // o kernel só é chamado quando a fila enche ou no wait_all
+    if (inflight == qdepth) {
+        enter(0);
+    }
+}
+
+// espera todas as requisições em andamento terminarem
+void IO_Uring::wait_all()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    while (inflight > 0) {
+        enter(inflight);
+    }
+}
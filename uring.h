@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+#include <mutex>
+#include <vector>
+
+// fila de io_uring usada pelo Disk::BACKEND_URING, feita direto com as
+// syscalls io_uring_setup/io_uring_enter (sem liburing). Cada requisição lê
+// ou escreve um bloco; até depth requisições ficam em andamento ao mesmo tempo.
+// Os anéis são compartilhados, então submit e wait_all se excluem entre threads
+class IO_Uring
+{
+public:
+    IO_Uring(int fd, int block_size, int depth, bool direct);
+    ~IO_Uring();
+
+    bool ok() { return ring_fd >= 0; }
+    int  depth() { return qdepth; }
+
+    void submit(int blocknum, char *data, bool writing);
+    void wait_all();
+
+private:
+    class request {
+        public:
+            char *data;     // buffer do chamador
+            char *bounce;   // buffer alinhado, usado com O_DIRECT
+            bool writing;
+    };
+
+    void enter(int min_complete);
+    void reap();
+    void release();
+
+private:
+    int fd;
+    int ring_fd;
+    int block_size;
+    int qdepth;
+    bool direct;
+    int inflight;       // requisições enviadas e ainda não completadas
+    int unsubmitted;    // requisições na SQ que o kernel ainda não viu
+
+    // anéis mapeados do kernel
+    void *sq_ptr;
+    void *cq_ptr;
+    void *sqes_ptr;
+    unsigned long sq_size;
+    unsigned long cq_size;
+    unsigned long sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *sqes;
+    void *cqes;
+
+    std::vector<request> requests;
+    std::vector<int> free_requests;
+    std::mutex lock;
+};
+
+#endif